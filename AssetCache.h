@@ -0,0 +1,101 @@
+#ifndef SPONZA_SCENE_ASSETCACHE_H
+#define SPONZA_SCENE_ASSETCACHE_H
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include "Texture.h"
+
+// Baked assets live under .cache/assets. An entry is named after a hash of its source file's path, size and
+// modification time plus the options it was baked with, so editing the source or bumping asset_cache_version
+// bakes it again; stale entries are never read, only left behind.
+
+const std::uint32_t asset_cache_version = 3;
+const std::uint32_t texture_cache_magic = 0x54584331; // "TXC1"
+
+std::uint64_t fnv1a(std::string_view data, std::uint64_t hash = 14695981039346656037ull)
+{
+    for (unsigned char c: data) {
+        hash ^= c;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+std::filesystem::path asset_cache_path(std::filesystem::path const &source, std::string_view options)
+{
+    std::error_code error;
+    auto size = std::filesystem::file_size(source, error);
+    auto time = std::filesystem::last_write_time(source, error).time_since_epoch().count();
+
+    std::uint64_t hash = fnv1a(source.string());
+    hash = fnv1a(options, hash);
+    hash = fnv1a(std::to_string(size) + ":" + std::to_string(time) + ":" + std::to_string(asset_cache_version), hash);
+
+    std::ostringstream file_name;
+    file_name << std::hex << std::setw(16) << std::setfill('0') << hash << ".bin";
+    return std::filesystem::path(PRACTICE_SOURCE_DIRECTORY "/.cache/assets") / file_name.str();
+}
+
+template <typename T>
+void write_value(std::ostream &file, T const &value)
+{
+    file.write(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+template <typename T>
+bool read_value(std::istream &file, T &value)
+{
+    return bool(file.read(reinterpret_cast<char *>(&value), sizeof(value)));
+}
+
+// Fills everything but t.path; returns false if there is no complete entry at path.
+bool load_cached_texture(std::filesystem::path const &path, texture &t)
+{
+    std::ifstream file(path, std::ios::binary);
+    std::uint32_t magic = 0, level_count = 0;
+    if (!read_value(file, magic) || magic != texture_cache_magic)
+        return false;
+    if (!read_value(file, t.width) || !read_value(file, t.height) || !read_value(file, t.channels)
+        || !read_value(file, t.srgb) || !read_value(file, t.encoding) || !read_value(file, level_count))
+        return false;
+
+    t.levels.resize(level_count);
+    for (std::size_t level = 0; level < level_count; level++) {
+        t.levels[level].resize(t.level_size(level));
+        if (!file.read(reinterpret_cast<char *>(t.levels[level].data()), t.levels[level].size()))
+            return false;
+    }
+    return level_count > 0;
+}
+
+void save_cached_texture(std::filesystem::path const &path, texture const &t)
+{
+    std::error_code error;
+    std::filesystem::create_directories(path.parent_path(), error);
+    // written aside and renamed, so a concurrent or interrupted run never sees half an entry
+    std::filesystem::path temporary = path;
+    temporary += ".tmp";
+    {
+        std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+        write_value(file, texture_cache_magic);
+        write_value(file, t.width);
+        write_value(file, t.height);
+        write_value(file, t.channels);
+        write_value(file, t.srgb);
+        write_value(file, t.encoding);
+        write_value(file, std::uint32_t(t.levels.size()));
+        for (auto &level: t.levels)
+            file.write(reinterpret_cast<const char *>(level.data()), level.size());
+        if (!file)
+            return;
+    }
+    std::filesystem::rename(temporary, path, error);
+}
+
+
+#endif
@@ -0,0 +1,215 @@
+#ifndef SPONZA_SCENE_BLOCKCOMPRESSION_H
+#define SPONZA_SCENE_BLOCKCOMPRESSION_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include "Texture.h"
+
+
+// CPU encoders for the BC1/BC3/BC4/BC5 block formats. Every 4x4 block is encoded independently: color endpoints
+// lie on the principal axis of the block's colors, single channels use their minimum and maximum. Edge blocks of
+// levels smaller than 4x4 repeat their last row and column.
+
+// when off, textures are baked and uploaded uncompressed
+inline bool compress_textures = true;
+
+// Albedo and specular maps become BC1, or BC3 with an alpha channel; normal maps keep x and y in BC5 and the
+// shader rebuilds z.
+inline TextureEncoding block_encoding(int channels, TextureUsage usage) {
+    if (usage == TEXTURE_NORMAL && channels >= 2)
+        return TEXTURE_BC5;
+    switch (channels) {
+        case 1: return TEXTURE_BC4;
+        case 2: return TEXTURE_BC5;
+        case 3: return TEXTURE_BC1;
+        default: return TEXTURE_BC3;
+    }
+}
+
+inline std::uint16_t pack_565(float r, float g, float b) {
+    auto quantize = [](float value, int max) {
+        return std::uint16_t(std::lround(std::clamp(value, 0.f, 255.f) * max / 255.f));
+    };
+    return std::uint16_t(quantize(r, 31) << 11 | quantize(g, 63) << 5 | quantize(b, 31));
+}
+
+inline void unpack_565(std::uint16_t color, int rgb[3]) {
+    int r = color >> 11, g = (color >> 5) & 63, b = color & 31;
+    rgb[0] = r << 3 | r >> 2;
+    rgb[1] = g << 2 | g >> 4;
+    rgb[2] = b << 3 | b >> 2;
+}
+
+// texels are RGBA, 8 bytes out
+inline void encode_bc1_block(const unsigned char texels[16][4], unsigned char *out) {
+    float mean[3] = {0.f, 0.f, 0.f};
+    for (int i = 0; i < 16; i++)
+        for (int c = 0; c < 3; c++)
+            mean[c] += texels[i][c] / 16.f;
+
+    float covariance[6] = {0.f, 0.f, 0.f, 0.f, 0.f, 0.f};
+    for (int i = 0; i < 16; i++) {
+        float d[3] = {texels[i][0] - mean[0], texels[i][1] - mean[1], texels[i][2] - mean[2]};
+        covariance[0] += d[0] * d[0];
+        covariance[1] += d[0] * d[1];
+        covariance[2] += d[0] * d[2];
+        covariance[3] += d[1] * d[1];
+        covariance[4] += d[1] * d[2];
+        covariance[5] += d[2] * d[2];
+    }
+
+    // a few power iterations are enough to find the principal axis
+    float axis[3] = {1.f, 1.f, 1.f};
+    for (int iteration = 0; iteration < 8; iteration++) {
+        float next[3] = {
+                covariance[0] * axis[0] + covariance[1] * axis[1] + covariance[2] * axis[2],
+                covariance[1] * axis[0] + covariance[3] * axis[1] + covariance[4] * axis[2],
+                covariance[2] * axis[0] + covariance[4] * axis[1] + covariance[5] * axis[2]
+        };
+        float length = std::max({std::abs(next[0]), std::abs(next[1]), std::abs(next[2])});
+        if (length < 1e-6f)
+            break;
+        for (int c = 0; c < 3; c++)
+            axis[c] = next[c] / length;
+    }
+
+    float axis_length = axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2];
+    float low = 0.f, high = 0.f;
+    for (int i = 0; i < 16; i++) {
+        float t = ((texels[i][0] - mean[0]) * axis[0] + (texels[i][1] - mean[1]) * axis[1]
+                   + (texels[i][2] - mean[2]) * axis[2]) / axis_length;
+        low = std::min(low, t);
+        high = std::max(high, t);
+    }
+    // pull the endpoints in a little, the extremes are covered by the interpolated colors anyway
+    float inset = (high - low) / 16.f;
+    low += inset;
+    high -= inset;
+
+    std::uint16_t color0 = pack_565(mean[0] + high * axis[0], mean[1] + high * axis[1], mean[2] + high * axis[2]);
+    std::uint16_t color1 = pack_565(mean[0] + low * axis[0], mean[1] + low * axis[1], mean[2] + low * axis[2]);
+    // color0 > color1 selects the four color mode, equal endpoints use index 0 only
+    if (color0 < color1)
+        std::swap(color0, color1);
+
+    std::uint32_t indices = 0;
+    if (color0 != color1) {
+        int palette[4][3];
+        unpack_565(color0, palette[0]);
+        unpack_565(color1, palette[1]);
+        for (int c = 0; c < 3; c++) {
+            palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+            palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+        }
+        for (int i = 0; i < 16; i++) {
+            int best = 0, best_distance = std::numeric_limits<int>::max();
+            for (int p = 0; p < 4; p++) {
+                int distance = 0;
+                for (int c = 0; c < 3; c++)
+                    distance += (texels[i][c] - palette[p][c]) * (texels[i][c] - palette[p][c]);
+                if (distance < best_distance) {
+                    best = p;
+                    best_distance = distance;
+                }
+            }
+            indices |= std::uint32_t(best) << (2 * i);
+        }
+    }
+
+    out[0] = color0 & 0xff;
+    out[1] = color0 >> 8;
+    out[2] = color1 & 0xff;
+    out[3] = color1 >> 8;
+    for (int i = 0; i < 4; i++)
+        out[4 + i] = (indices >> (8 * i)) & 0xff;
+}
+
+// channel of texels, 8 bytes out
+inline void encode_bc4_block(const unsigned char texels[16][4], int channel, unsigned char *out) {
+    int low = 255, high = 0;
+    for (int i = 0; i < 16; i++) {
+        low = std::min<int>(low, texels[i][channel]);
+        high = std::max<int>(high, texels[i][channel]);
+    }
+
+    // high > low selects the eight value mode, equal endpoints use index 0 only
+    std::uint64_t indices = 0;
+    if (high != low) {
+        int palette[8] = {high, low};
+        for (int p = 2; p < 8; p++)
+            palette[p] = ((8 - p) * high + (p - 1) * low) / 7;
+        for (int i = 0; i < 16; i++) {
+            int best = 0, best_distance = 256;
+            for (int p = 0; p < 8; p++) {
+                int distance = std::abs(texels[i][channel] - palette[p]);
+                if (distance < best_distance) {
+                    best = p;
+                    best_distance = distance;
+                }
+            }
+            indices |= std::uint64_t(best) << (3 * i);
+        }
+    }
+
+    out[0] = (unsigned char) high;
+    out[1] = (unsigned char) low;
+    for (int i = 0; i < 6; i++)
+        out[2 + i] = (indices >> (8 * i)) & 0xff;
+}
+
+inline std::vector<unsigned char> compress_level(std::vector<unsigned char> const &pixels, int width, int height,
+                                                 int channels, TextureEncoding encoding) {
+    std::size_t block_size = encoding == TEXTURE_BC1 || encoding == TEXTURE_BC4 ? 8 : 16;
+    int blocks_x = (width + 3) / 4, blocks_y = (height + 3) / 4;
+    std::vector<unsigned char> result(std::size_t(blocks_x) * blocks_y * block_size);
+
+    unsigned char *out = result.data();
+    for (int by = 0; by < blocks_y; by++) {
+        for (int bx = 0; bx < blocks_x; bx++) {
+            unsigned char texels[16][4];
+            for (int i = 0; i < 16; i++) {
+                int x = std::min(bx * 4 + i % 4, width - 1), y = std::min(by * 4 + i / 4, height - 1);
+                const unsigned char *texel = pixels.data() + (std::size_t(y) * width + x) * channels;
+                for (int c = 0; c < 4; c++)
+                    texels[i][c] = c < channels ? texel[c] : (c == 3 ? 255 : texel[0]);
+            }
+
+            switch (encoding) {
+                case TEXTURE_BC1:
+                    encode_bc1_block(texels, out);
+                    break;
+                case TEXTURE_BC3:
+                    encode_bc4_block(texels, 3, out);
+                    encode_bc1_block(texels, out + 8);
+                    break;
+                case TEXTURE_BC4:
+                    encode_bc4_block(texels, 0, out);
+                    break;
+                case TEXTURE_BC5:
+                    encode_bc4_block(texels, 0, out);
+                    encode_bc4_block(texels, 1, out + 8);
+                    break;
+                default:
+                    break;
+            }
+            out += block_size;
+        }
+    }
+    return result;
+}
+
+// Replaces the raw levels of t with their encoding.
+inline void compress_texture(texture &t, TextureEncoding encoding) {
+    if (t.encoding != TEXTURE_RAW || encoding == TEXTURE_RAW)
+        return;
+    for (std::size_t level = 0; level < t.levels.size(); level++)
+        t.levels[level] = compress_level(t.levels[level], t.level_width(level), t.level_height(level),
+                                         t.channels, encoding);
+    t.encoding = encoding;
+}
+
+
+#endif
@@ -0,0 +1,311 @@
+#ifndef SPONZA_SCENE_MESHLOD_H
+#define SPONZA_SCENE_MESHLOD_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <numeric>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+#include <glm/geometric.hpp>
+#include <glm/vec3.hpp>
+#include "AssetCache.h"
+#include "MeshOptimizer.h"
+
+
+// Levels of detail by quadric error metric edge collapses (Garland and Heckbert). A level is only a new index list
+// over the vertices of the full mesh, since every collapse moves a vertex onto one of its neighbours.
+
+// one level coarser than the previous
+struct mesh_lod {
+    // how far the surface moved, in model units, see simplify()
+    float error = 0.f;
+    std::vector<std::uint32_t> indices;
+};
+
+// squared distances to a set of planes, as the upper triangle of a symmetric 4x4 matrix, weighted by triangle area
+struct quadric {
+    double a2 = 0, ab = 0, ac = 0, ad = 0, b2 = 0, bc = 0, bd = 0, c2 = 0, cd = 0, d2 = 0, weight = 0;
+
+    void add_plane(glm::dvec3 n, double d, double w) {
+        a2 += w * n.x * n.x; ab += w * n.x * n.y; ac += w * n.x * n.z; ad += w * n.x * d;
+        b2 += w * n.y * n.y; bc += w * n.y * n.z; bd += w * n.y * d;
+        c2 += w * n.z * n.z; cd += w * n.z * d;
+        d2 += w * d * d;
+        weight += w;
+    }
+
+    void add(quadric const &q) {
+        a2 += q.a2; ab += q.ab; ac += q.ac; ad += q.ad;
+        b2 += q.b2; bc += q.bc; bd += q.bd;
+        c2 += q.c2; cd += q.cd;
+        d2 += q.d2;
+        weight += q.weight;
+    }
+
+    // mean squared distance of p to the planes
+    double error(glm::vec3 p) const {
+        double x = p.x, y = p.y, z = p.z;
+        double sum = a2 * x * x + 2 * ab * x * y + 2 * ac * x * z + 2 * ad * x
+                     + b2 * y * y + 2 * bc * y * z + 2 * bd * y
+                     + c2 * z * z + 2 * cd * z + d2;
+        return weight > 0 ? std::max(0.0, sum / weight) : 0.0;
+    }
+};
+
+// Collapses edges, cheapest first, until at most target_index_count indices are left or nothing more can collapse
+// without folding a triangle over. Vertices on the object border, which is also where its material ends, and on
+// seams, where vertices share a position but not their attributes, never move. error grows to the square root of
+// the largest collapse cost: the area-weighted RMS distance of a moved vertex to the planes it has absorbed.
+template <typename Vertex>
+std::vector<std::uint32_t> simplify(std::vector<Vertex> const &vertices, std::vector<std::uint32_t> indices,
+                                    std::size_t target_index_count, float &error) {
+    std::size_t vertex_count = vertices.size();
+
+    // vertices with the same position are one point of the surface
+    std::vector<std::uint32_t> position_id(vertex_count);
+    std::vector<std::uint32_t> position_users;
+    {
+        std::map<std::tuple<float, float, float>, std::uint32_t> positions;
+        for (std::size_t v = 0; v < vertex_count; v++) {
+            glm::vec3 p = vertices[v].position;
+            auto [it, inserted] = positions.try_emplace({p.x, p.y, p.z}, std::uint32_t(positions.size()));
+            position_id[v] = it->second;
+            if (inserted)
+                position_users.push_back(0);
+            position_users[it->second]++;
+        }
+    }
+
+    std::vector<bool> position_locked(position_users.size(), false);
+    for (std::size_t p = 0; p < position_users.size(); p++)
+        position_locked[p] = position_users[p] > 1;
+    // edges of one triangle are on the border, edges of more than two are not manifold
+    std::unordered_map<std::uint64_t, int> edge_triangles;
+    for (std::size_t i = 0; i < indices.size(); i++) {
+        std::uint64_t a = position_id[indices[i]], b = position_id[indices[i - i % 3 + (i % 3 + 1) % 3]];
+        edge_triangles[std::min(a, b) << 32 | std::max(a, b)]++;
+    }
+    for (auto const &[edge, count]: edge_triangles) {
+        if (count != 2) {
+            position_locked[edge >> 32] = true;
+            position_locked[edge & 0xffffffffu] = true;
+        }
+    }
+    std::vector<bool> locked(vertex_count);
+    for (std::size_t v = 0; v < vertex_count; v++)
+        locked[v] = position_locked[position_id[v]];
+
+    std::vector<quadric> quadrics(vertex_count);
+    for (std::size_t i = 0; i + 2 < indices.size(); i += 3) {
+        glm::dvec3 p0 = vertices[indices[i]].position, p1 = vertices[indices[i + 1]].position,
+                p2 = vertices[indices[i + 2]].position;
+        glm::dvec3 normal = glm::cross(p1 - p0, p2 - p0);
+        double length = glm::length(normal);
+        if (length == 0.0)
+            continue;
+        normal /= length;
+        for (int k = 0; k < 3; k++)
+            quadrics[indices[i + k]].add_plane(normal, -glm::dot(normal, p0), length / 2);
+    }
+
+    double max_cost = double(error) * error;
+    std::vector<std::uint32_t> offsets(vertex_count + 1), adjacency;
+    std::vector<std::uint32_t> remap(vertex_count);
+    std::vector<bool> touched(vertex_count);
+    // set for one pass when no collapse under the cost limit could be done
+    bool unlimited = false;
+    while (indices.size() > target_index_count) {
+        // triangles around every vertex
+        std::fill(offsets.begin(), offsets.end(), 0);
+        for (std::uint32_t index: indices)
+            offsets[index + 1]++;
+        for (std::size_t v = 0; v < vertex_count; v++)
+            offsets[v + 1] += offsets[v];
+        adjacency.resize(indices.size());
+        {
+            std::vector<std::uint32_t> fill(offsets.begin(), offsets.end() - 1);
+            for (std::size_t i = 0; i < indices.size(); i++)
+                adjacency[fill[indices[i]]++] = std::uint32_t(i / 3);
+        }
+
+        // the cheapest neighbour of every vertex that may move
+        struct collapse {
+            std::uint32_t from, to;
+            double cost;
+        };
+        std::vector<collapse> collapses;
+        for (std::uint32_t v = 0; v < vertex_count; v++) {
+            if (locked[v] || offsets[v] == offsets[v + 1])
+                continue;
+            collapse best = {v, v, std::numeric_limits<double>::max()};
+            for (std::uint32_t a = offsets[v]; a < offsets[v + 1]; a++) {
+                const std::uint32_t *triangle = indices.data() + 3 * adjacency[a];
+                for (int k = 0; k < 3; k++) {
+                    double cost = quadrics[v].error(vertices[triangle[k]].position);
+                    if (triangle[k] != v && cost < best.cost)
+                        best = {v, triangle[k], cost};
+                }
+            }
+            if (best.to != v)
+                collapses.push_back(best);
+        }
+        if (collapses.empty())
+            break;
+        std::sort(collapses.begin(), collapses.end(), [](collapse const &a, collapse const &b) {
+            return a.cost < b.cost;
+        });
+
+        // an interior collapse removes two triangles; nothing costlier than the ones needed is done in this pass
+        std::size_t needed = (indices.size() - target_index_count) / 6;
+        double cost_limit = unlimited ? std::numeric_limits<double>::max()
+                                      : collapses[std::min(needed, collapses.size() - 1)].cost;
+        std::size_t triangle_count = indices.size() / 3;
+        std::iota(remap.begin(), remap.end(), 0u);
+        std::fill(touched.begin(), touched.end(), false);
+        bool collapsed = false;
+        for (collapse const &c: collapses) {
+            if (c.cost > cost_limit || triangle_count * 3 <= target_index_count)
+                break;
+            if (touched[c.from] || touched[c.to])
+                continue;
+
+            // no triangle may turn over, or turn by more than about 75 degrees
+            bool flips = false;
+            std::size_t removed = 0;
+            for (std::uint32_t a = offsets[c.from]; a < offsets[c.from + 1] && !flips; a++) {
+                const std::uint32_t *triangle = indices.data() + 3 * adjacency[a];
+                if (triangle[0] == c.to || triangle[1] == c.to || triangle[2] == c.to) {
+                    removed++;
+                    continue;
+                }
+                glm::vec3 p[3], q[3];
+                for (int k = 0; k < 3; k++) {
+                    p[k] = vertices[triangle[k]].position;
+                    q[k] = triangle[k] == c.from ? vertices[c.to].position : p[k];
+                }
+                glm::vec3 before = glm::cross(p[1] - p[0], p[2] - p[0]), after = glm::cross(q[1] - q[0], q[2] - q[0]);
+                flips = glm::dot(before, after) <= 0.25f * glm::length(before) * glm::length(after);
+            }
+            if (flips)
+                continue;
+
+            // the triangles around a collapse don't take part in another one this pass, so their checks stay valid
+            for (std::uint32_t a = offsets[c.from]; a < offsets[c.from + 1]; a++)
+                for (int k = 0; k < 3; k++)
+                    touched[indices[3 * adjacency[a] + k]] = true;
+            remap[c.from] = c.to;
+            quadrics[c.to].add(quadrics[c.from]);
+            max_cost = std::max(max_cost, c.cost);
+            triangle_count -= removed;
+            collapsed = true;
+        }
+        if (!collapsed && unlimited)
+            break;
+        unlimited = !collapsed;
+
+        std::size_t kept = 0;
+        for (std::size_t i = 0; i + 2 < indices.size(); i += 3) {
+            std::uint32_t a = remap[indices[i]], b = remap[indices[i + 1]], c = remap[indices[i + 2]];
+            if (a == b || b == c || c == a)
+                continue;
+            indices[kept++] = a;
+            indices[kept++] = b;
+            indices[kept++] = c;
+        }
+        indices.resize(kept);
+    }
+    error = float(std::sqrt(max_cost));
+    return indices;
+}
+
+// Up to three levels of a half, a quarter and an eighth of the triangles, each simplified from the one before and
+// ordered for the vertex cache. The chain stops early once a level saves less than a tenth of the previous one.
+template <typename Vertex>
+std::vector<mesh_lod> generate_lods(std::vector<Vertex> const &vertices, std::vector<std::uint32_t> const &indices) {
+    std::vector<mesh_lod> lods;
+    std::vector<std::uint32_t> const *previous = &indices;
+    float error = 0.f;
+    for (int level = 1; level <= 3; level++) {
+        std::size_t target = indices.size() / 3 >> level;
+        auto simplified = simplify(vertices, *previous, target * 3, error);
+        if (simplified.empty() || simplified.size() * 10 > previous->size() * 9)
+            break;
+        optimize_vertex_cache(simplified, vertices.size());
+        lods.push_back({error, std::move(simplified)});
+        previous = &lods.back().indices;
+    }
+    return lods;
+}
+
+const std::uint32_t lod_cache_magic = 0x4c4f4431; // "LOD1"
+
+// vertex and index count of an object, which a cache entry has to match
+using lod_mesh_size = std::pair<std::uint32_t, std::uint32_t>;
+
+// Fills the levels of every object; returns false unless the entry at path is complete, baked for these sizes and
+// refers only to vertices the objects have.
+bool load_cached_lods(std::filesystem::path const &path, std::vector<lod_mesh_size> const &sizes,
+                      std::vector<std::vector<mesh_lod>> &lods)
+{
+    std::ifstream file(path, std::ios::binary);
+    std::uint32_t magic = 0, object_count = 0;
+    if (!read_value(file, magic) || magic != lod_cache_magic || !read_value(file, object_count)
+        || object_count != sizes.size())
+        return false;
+
+    lods.assign(object_count, {});
+    for (std::size_t object = 0; object < object_count; object++) {
+        lod_mesh_size size;
+        std::uint32_t level_count = 0;
+        if (!read_value(file, size.first) || !read_value(file, size.second) || size != sizes[object]
+            || !read_value(file, level_count))
+            return false;
+        lods[object].resize(level_count);
+        for (mesh_lod &lod: lods[object]) {
+            std::uint32_t index_count = 0;
+            if (!read_value(file, lod.error) || !read_value(file, index_count))
+                return false;
+            lod.indices.resize(index_count);
+            if (!file.read(reinterpret_cast<char *>(lod.indices.data()), index_count * sizeof(std::uint32_t)))
+                return false;
+            for (std::uint32_t index: lod.indices)
+                if (index >= size.first)
+                    return false;
+        }
+    }
+    return true;
+}
+
+void save_cached_lods(std::filesystem::path const &path, std::vector<lod_mesh_size> const &sizes,
+                      std::vector<std::vector<mesh_lod>> const &lods)
+{
+    std::error_code error;
+    std::filesystem::create_directories(path.parent_path(), error);
+    std::filesystem::path temporary = path;
+    temporary += ".tmp";
+    {
+        std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+        write_value(file, lod_cache_magic);
+        write_value(file, std::uint32_t(sizes.size()));
+        for (std::size_t object = 0; object < sizes.size(); object++) {
+            write_value(file, sizes[object].first);
+            write_value(file, sizes[object].second);
+            write_value(file, std::uint32_t(lods[object].size()));
+            for (mesh_lod const &lod: lods[object]) {
+                write_value(file, lod.error);
+                write_value(file, std::uint32_t(lod.indices.size()));
+                file.write(reinterpret_cast<const char *>(lod.indices.data()), lod.indices.size() * sizeof(std::uint32_t));
+            }
+        }
+        if (!file)
+            return;
+    }
+    std::filesystem::rename(temporary, path, error);
+}
+
+
+#endif
@@ -0,0 +1,357 @@
+#ifndef SPONZA_SCENE_MESHOPTIMIZER_H
+#define SPONZA_SCENE_MESHOPTIMIZER_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include <glm/geometric.hpp>
+#include <glm/vec3.hpp>
+
+
+// CPU passes that reorder an indexed triangle list for the post-transform vertex cache, then for overdraw, and then
+// the vertices for fetch locality. None changes what is drawn, only the order of triangles and vertices.
+
+// when off, objects keep the file order of their triangles
+inline bool optimize_meshes = true;
+
+struct vertex_cache_statistics {
+    // transformed vertices per triangle (0.5 at best for a regular grid, 3 at worst) and per vertex (1 at best)
+    float acmr = 0.f, atvr = 0.f;
+};
+
+// Simulates a FIFO post-transform cache of cache_size entries, which is what most GPUs are closer to than LRU.
+inline vertex_cache_statistics analyze_vertex_cache(std::vector<std::uint32_t> const &indices,
+                                                    std::size_t vertex_count, std::size_t cache_size = 16) {
+    vertex_cache_statistics statistics;
+    if (indices.empty())
+        return statistics;
+
+    // the vertex is in the cache while fifo_position - its entry time < cache_size
+    std::vector<std::size_t> entered(vertex_count, 0);
+    std::vector<bool> used(vertex_count, false);
+    std::size_t fifo_position = cache_size + 1, transformed = 0, unique = 0;
+    for (std::uint32_t index: indices) {
+        if (!used[index]) {
+            used[index] = true;
+            unique++;
+        }
+        if (entered[index] == 0 || fifo_position - entered[index] >= cache_size) {
+            entered[index] = fifo_position++;
+            transformed++;
+        }
+    }
+    statistics.acmr = float(transformed) / float(indices.size() / 3);
+    statistics.atvr = float(transformed) / float(unique);
+    return statistics;
+}
+
+// Tom Forsyth's linear-speed vertex cache optimization: triangles are emitted greedily by the score of their
+// vertices, which favours vertices in a simulated LRU cache and vertices with few triangles left.
+inline void optimize_vertex_cache(std::vector<std::uint32_t> &indices, std::size_t vertex_count) {
+    const int cache_size = 32;
+    const float cache_decay_power = 1.5f, last_triangle_score = 0.75f;
+    const float valence_boost_scale = 2.f, valence_boost_power = 0.5f;
+
+    std::size_t triangle_count = indices.size() / 3;
+    if (triangle_count == 0)
+        return;
+
+    auto vertex_score = [&](int cache_position, std::uint32_t remaining) {
+        if (remaining == 0)
+            return -1.f;
+        float score = 0.f;
+        if (cache_position >= 0) {
+            if (cache_position < 3)
+                score = last_triangle_score;
+            else
+                score = std::pow(1.f - float(cache_position - 3) / float(cache_size - 3), cache_decay_power);
+        }
+        return score + valence_boost_scale * std::pow(float(remaining), -valence_boost_power);
+    };
+
+    // triangles of every vertex; the first remaining[v] of them are the ones not emitted yet
+    std::vector<std::uint32_t> remaining(vertex_count, 0), offsets(vertex_count + 1, 0);
+    for (std::uint32_t index: indices)
+        remaining[index]++;
+    for (std::size_t v = 0; v < vertex_count; v++)
+        offsets[v + 1] = offsets[v] + remaining[v];
+    std::vector<std::uint32_t> adjacency(indices.size());
+    {
+        std::vector<std::uint32_t> fill(offsets.begin(), offsets.end() - 1);
+        for (std::size_t i = 0; i < indices.size(); i++)
+            adjacency[fill[indices[i]]++] = std::uint32_t(i / 3);
+    }
+
+    std::vector<int> cache_positions(vertex_count, -1);
+    std::vector<float> scores(vertex_count);
+    for (std::size_t v = 0; v < vertex_count; v++)
+        scores[v] = vertex_score(-1, remaining[v]);
+    std::vector<float> triangle_scores(triangle_count);
+    for (std::size_t t = 0; t < triangle_count; t++)
+        triangle_scores[t] = scores[indices[3 * t]] + scores[indices[3 * t + 1]] + scores[indices[3 * t + 2]];
+
+    std::vector<bool> emitted(triangle_count, false);
+    std::vector<std::uint32_t> cache, next_cache, result;
+    cache.reserve(cache_size + 3);
+    next_cache.reserve(cache_size + 3);
+    result.reserve(indices.size());
+
+    std::size_t cursor = 0;
+    std::int64_t best = 0;
+    while (result.size() < indices.size()) {
+        // nothing in the cache has triangles left: continue with the next triangle in input order
+        if (best < 0) {
+            while (emitted[cursor])
+                cursor++;
+            best = std::int64_t(cursor);
+        }
+
+        const std::uint32_t *triangle = indices.data() + 3 * best;
+        emitted[best] = true;
+        next_cache.assign(triangle, triangle + 3);
+        for (int k = 0; k < 3; k++) {
+            std::uint32_t v = triangle[k];
+            result.push_back(v);
+            std::uint32_t *begin = adjacency.data() + offsets[v];
+            std::uint32_t *last = begin + --remaining[v];
+            *std::find(begin, last + 1, std::uint32_t(best)) = *last;
+        }
+        for (std::uint32_t v: cache)
+            if (v != triangle[0] && v != triangle[1] && v != triangle[2])
+                next_cache.push_back(v);
+
+        // vertices pushed out of the cache lose their cache score as well
+        for (std::size_t i = cache_size; i < next_cache.size(); i++) {
+            cache_positions[next_cache[i]] = -1;
+            scores[next_cache[i]] = vertex_score(-1, remaining[next_cache[i]]);
+        }
+        if (next_cache.size() > std::size_t(cache_size))
+            next_cache.resize(cache_size);
+        for (std::size_t i = 0; i < next_cache.size(); i++) {
+            cache_positions[next_cache[i]] = int(i);
+            scores[next_cache[i]] = vertex_score(int(i), remaining[next_cache[i]]);
+        }
+        std::swap(cache, next_cache);
+
+        // only triangles around the cache changed their score, the best of them is emitted next
+        best = -1;
+        float best_score = -1.f;
+        for (std::uint32_t v: cache) {
+            for (std::uint32_t i = 0; i < remaining[v]; i++) {
+                std::uint32_t t = adjacency[offsets[v] + i];
+                triangle_scores[t] = scores[indices[3 * t]] + scores[indices[3 * t + 1]] + scores[indices[3 * t + 2]];
+                if (triangle_scores[t] > best_score) {
+                    best_score = triangle_scores[t];
+                    best = t;
+                }
+            }
+        }
+    }
+    indices = std::move(result);
+}
+
+// Sander, Nehab and Barczak's overdraw optimization on a cache-optimized list: the list is cut into clusters where the
+// simulated cache starts over, and further wherever a cluster's ACMR is within threshold of the one it had in one
+// piece, so no cluster loses more than that. Clusters whose area-weighted normal points away from the mesh centroid
+// are drawn first, as from any direction that sees them they tend to hide the rest.
+template <typename Vertex>
+void optimize_overdraw(std::vector<std::uint32_t> &indices, std::vector<Vertex> const &vertices,
+                       float threshold = 1.05f) {
+    const std::size_t cache_size = 16;
+    std::size_t triangle_count = indices.size() / 3;
+    if (triangle_count == 0)
+        return;
+
+    // same FIFO as analyze_vertex_cache; moving the position on by cache_size empties it
+    std::vector<std::size_t> entered(vertices.size(), 0);
+    std::size_t fifo_position = cache_size + 1;
+    auto misses = [&](std::size_t t) {
+        int count = 0;
+        for (int k = 0; k < 3; k++) {
+            std::uint32_t index = indices[3 * t + k];
+            if (entered[index] == 0 || fifo_position - entered[index] >= cache_size) {
+                entered[index] = fifo_position++;
+                count++;
+            }
+        }
+        return count;
+    };
+    auto reset = [&] { fifo_position += cache_size; };
+
+    std::vector<std::size_t> hard_boundaries;
+    for (std::size_t t = 0; t < triangle_count; t++)
+        if (misses(t) == 3)
+            hard_boundaries.push_back(t);
+    hard_boundaries.push_back(triangle_count);
+
+    std::vector<std::size_t> boundaries;
+    for (std::size_t c = 0; c + 1 < hard_boundaries.size(); c++) {
+        std::size_t begin = hard_boundaries[c], end = hard_boundaries[c + 1];
+        reset();
+        std::size_t cluster_misses = 0;
+        for (std::size_t t = begin; t < end; t++)
+            cluster_misses += misses(t);
+        float cluster_acmr = float(cluster_misses) / float(end - begin);
+
+        reset();
+        boundaries.push_back(begin);
+        std::size_t start = begin, piece_misses = 0;
+        for (std::size_t t = begin; t + 1 < end; t++) {
+            piece_misses += misses(t);
+            if (float(piece_misses) / float(t + 1 - start) <= threshold * cluster_acmr) {
+                reset();
+                boundaries.push_back(t + 1);
+                start = t + 1;
+                piece_misses = 0;
+            }
+        }
+    }
+    boundaries.push_back(triangle_count);
+
+    struct cluster {
+        std::size_t begin, end;
+        float sort_key;
+    };
+    std::vector<cluster> clusters;
+    std::vector<glm::vec3> centroids, normals;
+    glm::vec3 mesh_centroid(0.f);
+    float mesh_area = 0.f;
+    for (std::size_t c = 0; c + 1 < boundaries.size(); c++) {
+        glm::vec3 centroid(0.f), normal(0.f);
+        float area = 0.f;
+        for (std::size_t t = boundaries[c]; t < boundaries[c + 1]; t++) {
+            glm::vec3 p0 = vertices[indices[3 * t]].position, p1 = vertices[indices[3 * t + 1]].position,
+                    p2 = vertices[indices[3 * t + 2]].position;
+            glm::vec3 cross = glm::cross(p1 - p0, p2 - p0);
+            float triangle_area = glm::length(cross);
+            normal += cross;
+            centroid += (p0 + p1 + p2) * (triangle_area / 3.f);
+            area += triangle_area;
+        }
+        mesh_centroid += centroid;
+        mesh_area += area;
+        centroids.push_back(area > 0.f ? centroid / area : centroid);
+        normals.push_back(normal);
+        clusters.push_back({boundaries[c], boundaries[c + 1], 0.f});
+    }
+    if (mesh_area > 0.f)
+        mesh_centroid /= mesh_area;
+    for (std::size_t c = 0; c < clusters.size(); c++) {
+        float length = glm::length(normals[c]);
+        clusters[c].sort_key = length > 0.f ? glm::dot(centroids[c] - mesh_centroid, normals[c] / length) : 0.f;
+    }
+    std::stable_sort(clusters.begin(), clusters.end(), [](cluster const &a, cluster const &b) {
+        return a.sort_key > b.sort_key;
+    });
+
+    std::vector<std::uint32_t> result;
+    result.reserve(indices.size());
+    for (cluster const &c: clusters)
+        result.insert(result.end(), indices.begin() + 3 * c.begin, indices.begin() + 3 * c.end);
+    indices = std::move(result);
+}
+
+struct overdraw_statistics {
+    // pixels covered and fragments that passed the depth test, over all directions
+    std::size_t covered = 0, shaded = 0;
+
+    float overdraw() const {
+        return covered > 0 ? float(shaded) / float(covered) : 0.f;
+    }
+};
+
+// Rasterizes the triangles in order from the six axis directions, orthographically onto resolution^2 pixels fitted
+// to the mesh, with back faces culled and a less-than depth test as the opaque passes draw them.
+template <typename Vertex>
+overdraw_statistics analyze_overdraw(std::vector<Vertex> const &vertices, std::vector<std::uint32_t> const &indices,
+                                     int resolution = 256) {
+    overdraw_statistics statistics;
+    std::vector<float> depth(std::size_t(resolution) * resolution);
+    std::vector<glm::vec3> projected(vertices.size());
+    for (int direction = 0; direction < 6; direction++) {
+        glm::vec3 forward(0.f);
+        forward[direction / 2] = direction % 2 ? -1.f : 1.f;
+        glm::vec3 up = direction / 2 == 1 ? glm::vec3(0.f, 0.f, 1.f) : glm::vec3(0.f, 1.f, 0.f);
+        // right x up == forward, so counter-clockwise on screen faces the viewer, who looks along -forward
+        glm::vec3 right = glm::normalize(glm::cross(up, forward));
+        up = glm::cross(forward, right);
+
+        glm::vec3 low(std::numeric_limits<float>::max()), high(std::numeric_limits<float>::lowest());
+        for (std::size_t v = 0; v < vertices.size(); v++) {
+            glm::vec3 p = vertices[v].position;
+            projected[v] = {glm::dot(p, right), glm::dot(p, up), -glm::dot(p, forward)};
+            low = glm::min(low, projected[v]);
+            high = glm::max(high, projected[v]);
+        }
+        float extent = std::max(high.x - low.x, high.y - low.y);
+        if (!(extent > 0.f))
+            continue;
+        float scale = float(resolution) / extent;
+        for (glm::vec3 &p: projected) {
+            p.x = (p.x - low.x) * scale;
+            p.y = (p.y - low.y) * scale;
+        }
+
+        std::fill(depth.begin(), depth.end(), std::numeric_limits<float>::max());
+        auto edge = [](glm::vec3 const &a, glm::vec3 const &b, float x, float y) {
+            return (b.x - a.x) * (y - a.y) - (b.y - a.y) * (x - a.x);
+        };
+        for (std::size_t i = 0; i + 2 < indices.size(); i += 3) {
+            glm::vec3 const &a = projected[indices[i]], &b = projected[indices[i + 1]], &c = projected[indices[i + 2]];
+            float area = edge(a, b, c.x, c.y);
+            if (area <= 0.f)
+                continue;
+            int x0 = std::max(0, int(std::floor(std::min({a.x, b.x, c.x}))));
+            int y0 = std::max(0, int(std::floor(std::min({a.y, b.y, c.y}))));
+            int x1 = std::min(resolution - 1, int(std::ceil(std::max({a.x, b.x, c.x}))));
+            int y1 = std::min(resolution - 1, int(std::ceil(std::max({a.y, b.y, c.y}))));
+            for (int y = y0; y <= y1; y++) {
+                for (int x = x0; x <= x1; x++) {
+                    float px = x + 0.5f, py = y + 0.5f;
+                    float wa = edge(b, c, px, py), wb = edge(c, a, px, py), wc = edge(a, b, px, py);
+                    if (wa < 0.f || wb < 0.f || wc < 0.f)
+                        continue;
+                    float z = (wa * a.z + wb * b.z + wc * c.z) / area;
+                    float &stored = depth[std::size_t(y) * resolution + x];
+                    if (z < stored) {
+                        if (stored == std::numeric_limits<float>::max())
+                            statistics.covered++;
+                        stored = z;
+                        statistics.shaded++;
+                    }
+                }
+            }
+        }
+    }
+    return statistics;
+}
+
+// Orders vertices by their first use in indices and remaps indices to match; unreferenced vertices go last.
+// Returns the old number of every vertex, for streams kept beside vertices.
+template <typename Vertex>
+std::vector<std::uint32_t> optimize_vertex_fetch(std::vector<Vertex> &vertices, std::vector<std::uint32_t> &indices) {
+    const std::uint32_t unused = ~0u;
+    std::vector<std::uint32_t> remap(vertices.size(), unused), sources;
+    sources.reserve(vertices.size());
+    for (std::uint32_t &index: indices) {
+        if (remap[index] == unused) {
+            remap[index] = std::uint32_t(sources.size());
+            sources.push_back(index);
+        }
+        index = remap[index];
+    }
+    for (std::uint32_t v = 0; v < vertices.size(); v++)
+        if (remap[v] == unused)
+            sources.push_back(v);
+    std::vector<Vertex> result;
+    result.reserve(vertices.size());
+    for (std::uint32_t v: sources)
+        result.push_back(vertices[v]);
+    vertices = std::move(result);
+    return sources;
+}
+
+
+#endif
@@ -0,0 +1,250 @@
+#ifndef SPONZA_SCENE_MESHLETS_H
+#define SPONZA_SCENE_MESHLETS_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include <glm/geometric.hpp>
+#include <glm/mat4x4.hpp>
+#include <glm/matrix.hpp>
+#include <glm/vec3.hpp>
+#include <glm/vec4.hpp>
+
+
+// Meshlets are small connected groups of triangles of an object with few enough vertices to be culled as a whole: by their
+// bounding sphere against the frustum, and by the cone around their triangle normals when no triangle can face the
+// viewer. Building them reorders the triangles so that every meshlet is a range of the index buffer: the ones that
+// survive culling are drawn as ranges, adjacent ones merged.
+
+const std::size_t meshlet_max_vertices = 64;
+const std::size_t meshlet_max_triangles = 124;
+
+struct meshlet {
+    std::uint32_t index_offset, index_count;
+    glm::vec3 center;
+    float radius;
+    // every triangle normal is within the angle whose sine is cone_sin of cone_axis; cone_sin > 1 if the normals
+    // spread over a hemisphere or more, and the meshlet can't be back-facing
+    glm::vec3 cone_axis;
+    float cone_sin;
+};
+
+struct MeshletCullStats {
+    std::size_t tested = 0, back_facing = 0, outside = 0, triangles = 0;
+};
+
+// Reorders the triangles of indices into meshlets and returns them. Each meshlet starts at the first triangle left in
+// the current order and grows by the triangle that shares the most vertices with it, nearest first, so it stays
+// connected and compact; when no neighbour fits, it takes the next triangle in order. Growing pulls triangles forward
+// from later in the order, so the meshlets are then sorted by the mean position their triangles had: an order
+// optimized for overdraw survives at the granularity of meshlets.
+template <typename Vertex>
+std::vector<meshlet> build_meshlets(std::vector<Vertex> const &vertices, std::vector<std::uint32_t> &indices) {
+    std::size_t triangle_count = indices.size() / 3;
+    std::vector<std::uint32_t> first(vertices.size() + 1, 0), adjacent(triangle_count * 3);
+    for (std::size_t i = 0; i < triangle_count * 3; i++)
+        first[indices[i] + 1]++;
+    for (std::size_t v = 0; v < vertices.size(); v++)
+        first[v + 1] += first[v];
+    {
+        std::vector<std::uint32_t> filled(first.begin(), first.end() - 1);
+        for (std::size_t i = 0; i < triangle_count * 3; i++)
+            adjacent[filled[indices[i]]++] = std::uint32_t(i / 3);
+    }
+
+    std::vector<meshlet> meshlets;
+    // sum of the positions in indices of the triangles of every meshlet
+    std::vector<double> order_sums;
+    double order_sum = 0.;
+    std::vector<std::uint32_t> result;
+    result.reserve(indices.size());
+    std::vector<bool> emitted(triangle_count, false);
+    // stamp[v] == meshlets.size() + 1 while v is in the meshlet being built
+    std::vector<std::uint32_t> stamp(vertices.size(), 0);
+    std::vector<std::uint32_t> meshlet_vertices, candidates;
+    glm::vec3 vertex_sum(0.f);
+    std::size_t begin = 0, next = 0;
+
+    auto in_meshlet = [&](std::uint32_t v) {
+        return stamp[v] == meshlets.size() + 1;
+    };
+    auto shared_vertices = [&](std::size_t triangle) {
+        int shared = 0;
+        for (int k = 0; k < 3; k++)
+            shared += in_meshlet(indices[triangle * 3 + k]);
+        return shared;
+    };
+
+    auto finish = [&]() {
+        std::size_t end = result.size();
+        if (end == begin)
+            return;
+        meshlet m = {std::uint32_t(begin), std::uint32_t(end - begin), glm::vec3(0.f), 0.f, glm::vec3(0.f), 0.f};
+
+        glm::vec3 low(std::numeric_limits<float>::max()), high(std::numeric_limits<float>::lowest());
+        for (std::uint32_t v: meshlet_vertices) {
+            low = glm::min(low, vertices[v].position);
+            high = glm::max(high, vertices[v].position);
+        }
+        m.center = (low + high) * 0.5f;
+        m.radius = 0.f;
+        for (std::uint32_t v: meshlet_vertices)
+            m.radius = std::max(m.radius, glm::length(vertices[v].position - m.center));
+
+        std::vector<glm::vec3> normals;
+        glm::vec3 sum(0.f);
+        for (std::size_t i = begin; i < end; i += 3) {
+            glm::vec3 p0 = vertices[result[i]].position, p1 = vertices[result[i + 1]].position,
+                    p2 = vertices[result[i + 2]].position;
+            glm::vec3 normal = glm::cross(p1 - p0, p2 - p0);
+            float length = glm::length(normal);
+            if (length == 0.f)
+                continue;
+            normals.push_back(normal / length);
+            sum += normals.back();
+        }
+        float sum_length = glm::length(sum);
+        m.cone_axis = sum_length > 0.f ? sum / sum_length : glm::vec3(0.f, 0.f, 1.f);
+        float cone_cos = sum_length > 0.f ? 1.f : -1.f;
+        for (glm::vec3 const &normal: normals)
+            cone_cos = std::min(cone_cos, glm::dot(normal, m.cone_axis));
+        m.cone_sin = cone_cos > 0.f ? std::sqrt(1.f - cone_cos * cone_cos) : 2.f;
+
+        meshlets.push_back(m);
+        order_sums.push_back(order_sum);
+        order_sum = 0.;
+        meshlet_vertices.clear();
+        vertex_sum = glm::vec3(0.f);
+        candidates.clear();
+        begin = end;
+    };
+
+    auto add = [&](std::size_t triangle) {
+        emitted[triangle] = true;
+        order_sum += double(triangle);
+        for (int k = 0; k < 3; k++) {
+            std::uint32_t v = indices[triangle * 3 + k];
+            result.push_back(v);
+            if (in_meshlet(v))
+                continue;
+            stamp[v] = std::uint32_t(meshlets.size() + 1);
+            meshlet_vertices.push_back(v);
+            vertex_sum += vertices[v].position;
+            for (std::uint32_t i = first[v]; i < first[v + 1]; i++)
+                if (!emitted[adjacent[i]])
+                    candidates.push_back(adjacent[i]);
+        }
+    };
+
+    for (std::size_t added = 0; added < triangle_count; added++) {
+        if ((result.size() - begin) / 3 >= meshlet_max_triangles)
+            finish();
+
+        // ties go to the triangle nearest to the meshlet, which keeps it round and its normal cone narrow
+        glm::vec3 center = vertex_sum / float(std::max<std::size_t>(meshlet_vertices.size(), 1));
+        std::size_t best = triangle_count;
+        int best_shared = 0;
+        float best_distance = 0.f;
+        std::size_t kept = 0;
+        for (std::uint32_t triangle: candidates) {
+            if (emitted[triangle])
+                continue;
+            candidates[kept++] = triangle;
+            int shared = shared_vertices(triangle);
+            if (meshlet_vertices.size() + 3 - shared > meshlet_max_vertices)
+                continue;
+            glm::vec3 centroid = (vertices[indices[triangle * 3]].position + vertices[indices[triangle * 3 + 1]].position
+                                  + vertices[indices[triangle * 3 + 2]].position) / 3.f;
+            float distance = glm::length(centroid - center);
+            if (shared > best_shared || (shared == best_shared && shared > 0 && distance < best_distance)) {
+                best = triangle;
+                best_shared = shared;
+                best_distance = distance;
+            }
+        }
+        candidates.resize(kept);
+
+        if (best == triangle_count) {
+            while (emitted[next])
+                next++;
+            best = next;
+            if (meshlet_vertices.size() + 3 - shared_vertices(best) > meshlet_max_vertices)
+                finish();
+        }
+        add(best);
+    }
+    finish();
+
+    std::vector<std::size_t> order(meshlets.size());
+    for (std::size_t i = 0; i < order.size(); i++)
+        order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](std::size_t a, std::size_t b) {
+        return order_sums[a] / meshlets[a].index_count < order_sums[b] / meshlets[b].index_count;
+    });
+    std::vector<meshlet> sorted;
+    sorted.reserve(meshlets.size());
+    indices.clear();
+    for (std::size_t i: order) {
+        meshlet m = meshlets[i];
+        indices.insert(indices.end(), result.begin() + m.index_offset, result.begin() + m.index_offset + m.index_count);
+        m.index_offset = std::uint32_t(indices.size() - m.index_count);
+        sorted.push_back(m);
+    }
+    return sorted;
+}
+
+// Culls meshlets for one pass, given the transform from model to clip space.
+class MeshletCuller {
+private:
+    glm::vec4 planes[6];
+    // camera position in model space, or its view direction for an orthographic projection
+    glm::vec3 eye;
+    bool orthographic;
+    float facing;
+
+public:
+    // cull_front_faces for passes that draw the back faces, like the shadow pass
+    MeshletCuller(glm::mat4 const &transform, bool cull_front_faces) {
+        glm::mat4 rows = glm::transpose(transform);
+        for (int axis = 0; axis < 3; axis++) {
+            planes[2 * axis] = rows[3] + rows[axis];
+            planes[2 * axis + 1] = rows[3] - rows[axis];
+        }
+
+        // the point that projects to w = 0 and the center of the screen
+        glm::vec4 e = glm::inverse(transform) * glm::vec4(0.f, 0.f, 1.f, 0.f);
+        orthographic = std::abs(e.w) <= 1e-6f * glm::length(glm::vec3(e));
+        eye = orthographic ? glm::normalize(glm::vec3(e)) : glm::vec3(e) / e.w;
+        facing = cull_front_faces ? -1.f : 1.f;
+    }
+
+    bool visible(meshlet const &m, MeshletCullStats &stats) const {
+        for (glm::vec4 const &plane: planes) {
+            if (glm::dot(glm::vec3(plane), m.center) + plane.w < -m.radius * glm::length(glm::vec3(plane))) {
+                stats.outside++;
+                return false;
+            }
+        }
+
+        // back-facing if every direction from the eye to the sphere is within 90 degrees minus the cone angle of
+        // the axis, so that it makes a positive dot product with every normal
+        glm::vec3 axis = m.cone_axis * facing;
+        bool back_facing;
+        if (orthographic) {
+            back_facing = glm::dot(eye, axis) > m.cone_sin;
+        } else {
+            glm::vec3 direction = m.center - eye;
+            back_facing = glm::dot(direction, axis) > m.cone_sin * glm::length(direction) + m.radius * (1.f + m.cone_sin);
+        }
+        if (back_facing) {
+            stats.back_facing++;
+            return false;
+        }
+        return true;
+    }
+};
+
+
+#endif
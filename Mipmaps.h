@@ -0,0 +1,101 @@
+#ifndef SPONZA_SCENE_MIPMAPS_H
+#define SPONZA_SCENE_MIPMAPS_H
+
+#include <cmath>
+#include <vector>
+#include "Texture.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define SPONZA_SCENE_MIPMAPS_SSE2
+#endif
+
+
+// Mip chains are built on the CPU with a 2x2 box filter. Texels are decoded to linear floats through a table,
+// averaged and encoded back through a 4096-entry table, so sRGB color channels are filtered in linear space
+// while alpha and non-color textures are averaged as they are.
+
+struct mip_tables {
+    float srgb_to_float[256], unorm_to_float[256];
+    unsigned char float_to_srgb[4096], float_to_unorm[4096];
+
+    mip_tables() {
+        for (int i = 0; i < 256; i++) {
+            float c = i / 255.f;
+            srgb_to_float[i] = c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+            unorm_to_float[i] = c;
+        }
+        for (int i = 0; i < 4096; i++) {
+            float l = i / 4095.f;
+            float c = l <= 0.0031308f ? l * 12.92f : 1.055f * std::pow(l, 1.f / 2.4f) - 0.055f;
+            float_to_srgb[i] = (unsigned char) std::lround(c * 255.f);
+            float_to_unorm[i] = (unsigned char) std::lround(l * 255.f);
+        }
+    }
+};
+
+inline mip_tables const &get_mip_tables() {
+    static const mip_tables tables;
+    return tables;
+}
+
+// Halves a width x height level; odd edges repeat their last row or column.
+inline std::vector<unsigned char> downsample(std::vector<unsigned char> const &source, int width, int height,
+                                             int channels, bool srgb) {
+    mip_tables const &tables = get_mip_tables();
+    const float *decode[4];
+    const unsigned char *encode[4];
+    for (int c = 0; c < 4; c++) {
+        bool alpha = (channels == 4 && c == 3) || (channels == 2 && c == 1);
+        bool color = srgb && !alpha;
+        decode[c] = color ? tables.srgb_to_float : tables.unorm_to_float;
+        encode[c] = color ? tables.float_to_srgb : tables.float_to_unorm;
+    }
+
+    int out_width = std::max(1, width / 2), out_height = std::max(1, height / 2);
+    std::vector<unsigned char> result(std::size_t(out_width) * out_height * channels);
+    for (int y = 0; y < out_height; y++) {
+        const unsigned char *rows[2] = {
+                source.data() + std::size_t(std::min(2 * y, height - 1)) * width * channels,
+                source.data() + std::size_t(std::min(2 * y + 1, height - 1)) * width * channels
+        };
+        unsigned char *out = result.data() + std::size_t(y) * out_width * channels;
+        for (int x = 0; x < out_width; x++) {
+            int columns[2] = {std::min(2 * x, width - 1) * channels, std::min(2 * x + 1, width - 1) * channels};
+            // one lane per channel, unused lanes stay zero
+            float texels[4][4] = {};
+            for (int i = 0; i < 4; i++) {
+                const unsigned char *texel = rows[i / 2] + columns[i % 2];
+                for (int c = 0; c < channels; c++)
+                    texels[i][c] = decode[c][texel[c]];
+            }
+
+            int indices[4];
+#ifdef SPONZA_SCENE_MIPMAPS_SSE2
+            __m128 sum = _mm_add_ps(_mm_add_ps(_mm_loadu_ps(texels[0]), _mm_loadu_ps(texels[1])),
+                                    _mm_add_ps(_mm_loadu_ps(texels[2]), _mm_loadu_ps(texels[3])));
+            __m128i index = _mm_cvtps_epi32(_mm_mul_ps(sum, _mm_set1_ps(4095.f / 4.f)));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(indices), index);
+#else
+            for (int c = 0; c < 4; c++) {
+                float sum = texels[0][c] + texels[1][c] + texels[2][c] + texels[3][c];
+                indices[c] = int(std::lround(sum * (4095.f / 4.f)));
+            }
+#endif
+            for (int c = 0; c < channels; c++)
+                out[x * channels + c] = encode[c][std::clamp(indices[c], 0, 4095)];
+        }
+    }
+    return result;
+}
+
+// Fills t.levels from levels[0] down to 1x1.
+inline void generate_mipmaps(texture &t) {
+    t.levels.resize(1);
+    for (std::size_t level = 0; t.level_width(level) > 1 || t.level_height(level) > 1; level++)
+        t.levels.push_back(downsample(t.levels[level], t.level_width(level), t.level_height(level),
+                                      t.channels, t.srgb));
+}
+
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef SPONZA_SCENE_MODELLOADER_H
+#define SPONZA_SCENE_MODELLOADER_H
+
+#include <chrono>
+#include <fstream>
+#include <future>
+#include "Parser.h"
+
+
+// The models the viewer shows, with the scale it loads each at; bake bakes their assets at the same scales.
+struct model_source {
+    const char *mtl_path, *obj_path;
+    float scale_factor;
+};
+
+const model_source sponza_model = {"/sponza/sponza.mtl", "/sponza/sponza.obj", 1500.f};
+const model_source shrek_model = {"/shrek/shrek.mtl", "/shrek/shrek.obj", 100.f};
+
+struct Model {
+    std::map<std::string, mtl_object> mtl;
+    std::map<std::string, texture> textures;
+    std::vector<Object> objects;
+};
+
+// Parses and decodes a model on worker threads as soon as it is constructed, which can be before any GL context
+// exists. The materials become available first, the textures and objects (with their levels of detail) are decoded
+// in parallel after them.
+class ModelLoader {
+private:
+    std::shared_future<std::map<std::string, mtl_object>> materials;
+    std::future<std::map<std::string, texture>> textures;
+    std::future<std::vector<Object>> objects;
+
+    template <typename T>
+    static bool is_ready(T const &future) {
+        return future.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    }
+
+public:
+    ModelLoader(std::string mtl_path, std::string obj_path, float scale_factor) {
+        materials = std::async(std::launch::async, [mtl_path] {
+            std::ifstream mtl_file(PRACTICE_SOURCE_DIRECTORY + mtl_path);
+            return Parser::load_mtl(mtl_file);
+        }).share();
+
+        textures = std::async(std::launch::async, [materials = materials] {
+            return Parser::load_textures(materials.get());
+        });
+
+        objects = std::async(std::launch::async, [materials = materials, obj_path, scale_factor] {
+            auto mtl = materials.get();
+            std::ifstream obj_file(PRACTICE_SOURCE_DIRECTORY + obj_path);
+            auto objects = Parser::load_obj(obj_file, mtl, scale_factor, PRACTICE_SOURCE_DIRECTORY + obj_path);
+            Parser::build_lods(objects, PRACTICE_SOURCE_DIRECTORY + obj_path, scale_factor);
+            return objects;
+        });
+    }
+
+    bool materials_ready() const {
+        return is_ready(materials);
+    }
+
+    std::map<std::string, mtl_object> const &get_materials() const {
+        return materials.get();
+    }
+
+    bool ready() const {
+        return is_ready(textures) && is_ready(objects);
+    }
+
+    // Blocks until everything is decoded; rethrows errors from the worker threads.
+    Model get() {
+        return {materials.get(), textures.get(), objects.get()};
+    }
+};
+
+
+#endif
@@ -0,0 +1,132 @@
+#ifndef SPONZA_SCENE_NORMALS_H
+#define SPONZA_SCENE_NORMALS_H
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <future>
+#include <thread>
+#include <vector>
+#include <glm/geometric.hpp>
+#include <glm/vec3.hpp>
+
+
+// Smooth normals for the corners of an OBJ that has none: each one is the sum of the normals of the faces around its
+// position in the same smoothing group, weighted by the angle of the face at that corner, so that a vertex doesn't
+// lean towards the side that happens to be cut into more triangles. Faces in smoothing group 0 ("s off", also the
+// default) stay flat.
+
+// Runs body(begin, end) over chunks of [0, count) on all cores.
+template <typename Body>
+void parallel_chunks(std::size_t count, Body const &body) {
+    const std::size_t chunk = 1 << 16;
+    std::atomic<std::size_t> next = 0;
+    std::vector<std::future<void>> workers;
+    unsigned worker_count = std::min<std::size_t>(std::max(1u, std::thread::hardware_concurrency()), count / chunk + 1);
+    for (unsigned i = 0; i < worker_count; i++)
+        workers.push_back(std::async(std::launch::async, [&] {
+            for (std::size_t begin; (begin = next.fetch_add(chunk)) < count;)
+                body(begin, std::min(begin + chunk, count));
+        }));
+    for (auto &worker: workers)
+        worker.get();
+}
+
+// Gives every corner whose normal index is missing a generated normal: appends one normal per position and
+// smoothing group (per plane in group 0) to normals and points the corner at it. face_groups has the smoothing group
+// of every triangle. Returns how many normals were added.
+inline std::size_t generate_normals(std::vector<glm::vec3> const &positions,
+                                    std::vector<std::uint32_t> const &position_indices,
+                                    std::vector<std::uint32_t> const &face_groups, std::vector<std::uint32_t> &normal_indices,
+                                    std::uint32_t missing, std::vector<glm::vec3> &normals) {
+    std::size_t corner_count = position_indices.size() - position_indices.size() % 3;
+
+    // angle weighted face normal of every corner, zero for corners that have a normal; and the smoothing key of
+    // every face: its group, or for flat faces its normal, so that coplanar faces still share vertices
+    std::vector<glm::vec3> weighted(corner_count);
+    std::vector<std::uint64_t> face_keys(corner_count / 3);
+    parallel_chunks(corner_count / 3, [&](std::size_t begin, std::size_t end) {
+        for (std::size_t f = begin; f < end; f++) {
+            std::size_t c = f * 3;
+            if (normal_indices[c] != missing && normal_indices[c + 1] != missing && normal_indices[c + 2] != missing) {
+                weighted[c] = weighted[c + 1] = weighted[c + 2] = glm::vec3(0.f);
+                continue;
+            }
+            glm::vec3 p[3];
+            for (int k = 0; k < 3; k++)
+                p[k] = positions[position_indices[c + k]];
+            glm::vec3 normal = glm::cross(p[1] - p[0], p[2] - p[0]);
+            float length = glm::length(normal);
+            normal = length > 0.f ? normal / length : glm::vec3(0.f);
+
+            face_keys[f] = face_groups[f];
+            if (face_groups[f] == 0) {
+                face_keys[f] = std::uint64_t(1) << 63;
+                for (int axis = 0; axis < 3; axis++)
+                    face_keys[f] |= std::uint64_t(std::lround((normal[axis] + 1.f) * 0.5f * 0xfffff)) << (20 * axis);
+            }
+            for (int k = 0; k < 3; k++) {
+                glm::vec3 a = p[(k + 1) % 3] - p[k], b = p[(k + 2) % 3] - p[k];
+                float lengths = glm::length(a) * glm::length(b);
+                float angle = lengths > 0.f ? std::acos(std::clamp(glm::dot(a, b) / lengths, -1.f, 1.f)) : 0.f;
+                weighted[c + k] = normal * angle;
+            }
+        }
+    });
+
+    // corners that need a normal, grouped by position
+    std::vector<std::uint32_t> first(positions.size() + 1, 0);
+    for (std::size_t c = 0; c < corner_count; c++)
+        if (normal_indices[c] == missing)
+            first[position_indices[c] + 1]++;
+    for (std::size_t v = 0; v < positions.size(); v++)
+        first[v + 1] += first[v];
+    std::vector<std::uint32_t> corners(first.back());
+    {
+        std::vector<std::uint32_t> filled(first.begin(), first.end() - 1);
+        for (std::size_t c = 0; c < corner_count; c++)
+            if (normal_indices[c] == missing)
+                corners[filled[position_indices[c]]++] = std::uint32_t(c);
+    }
+
+    auto key = [&](std::uint32_t c) {
+        return face_keys[c / 3];
+    };
+
+    // the corners of every position sorted by key, one normal per run of equal keys
+    std::vector<std::uint32_t> key_count(positions.size() + 1, 0);
+    parallel_chunks(positions.size(), [&](std::size_t begin, std::size_t end) {
+        for (std::size_t v = begin; v < end; v++) {
+            auto position_corners = corners.begin() + first[v], position_end = corners.begin() + first[v + 1];
+            std::sort(position_corners, position_end, [&](std::uint32_t a, std::uint32_t b) {
+                return key(a) < key(b) || (key(a) == key(b) && a < b);
+            });
+            for (auto i = position_corners; i != position_end; i++)
+                key_count[v + 1] += i == position_corners || key(*i) != key(*(i - 1));
+        }
+    });
+    for (std::size_t v = 0; v < positions.size(); v++)
+        key_count[v + 1] += key_count[v];
+
+    std::size_t base = normals.size();
+    normals.resize(base + key_count.back());
+    parallel_chunks(positions.size(), [&](std::size_t begin, std::size_t end) {
+        for (std::size_t v = begin; v < end; v++) {
+            std::size_t normal = base + key_count[v];
+            for (std::uint32_t run = first[v], run_end; run < first[v + 1]; run = run_end, normal++) {
+                glm::vec3 sum(0.f);
+                for (run_end = run; run_end < first[v + 1] && key(corners[run_end]) == key(corners[run]); run_end++)
+                    sum += weighted[corners[run_end]];
+                float length = glm::length(sum);
+                normals[normal] = length > 0.f ? sum / length : glm::vec3(0.f, 0.f, 1.f);
+                for (std::uint32_t i = run; i < run_end; i++)
+                    normal_indices[corners[i]] = std::uint32_t(normal);
+            }
+        }
+    });
+    return key_count.back();
+}
+
+
+#endif
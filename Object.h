@@ -5,6 +5,14 @@
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb_image.h>
 #include <glm/vec2.hpp>
+#include <glm/mat4x4.hpp>
+#include "TextureRegistry.h"
+#include "MeshLod.h"
+#include "Meshlets.h"
+#include "VertexFormat.h"
+#include <glm/common.hpp>
+#include <limits>
+#include <cmath>
 
 
 #ifndef SPONZA_SCENE_OBJECT_H
@@ -17,6 +25,9 @@ struct vertex
     glm::vec2 texcoord;
 };
 
+// objects with at most this many vertices get 16-bit index buffers; load_obj splits larger ones
+const std::size_t short_index_vertex_limit = 65536;
+
 struct mtl_object {
     float Ns, Ni, d, Tr;
     int illum;
@@ -33,49 +44,207 @@ struct mtl_object {
         Kd.x = Kd.y = Kd.z = 0;    }
 };
 
-struct texture {
-    int width = 0, height = 0, channels = 0;
-    std::vector<unsigned char> data;
+struct bounding_box {
+    glm::vec3 min = glm::vec3(std::numeric_limits<float>::max());
+    glm::vec3 max = glm::vec3(std::numeric_limits<float>::lowest());
+
+    void extend(glm::vec3 const &p) {
+        min = glm::min(min, p);
+        max = glm::max(max, p);
+    }
+
+    void extend(bounding_box const &b) {
+        min = glm::min(min, b.min);
+        max = glm::max(max, b.max);
+    }
+
+    glm::vec3 corner(int i) const {
+        return {(i & 1) ? max.x : min.x, (i & 2) ? max.y : min.y, (i & 4) ? max.z : min.z};
+    }
+
+    // Conservative test against the clip volume of transform: false only if all corners are outside one clip plane.
+    bool intersects(glm::mat4 const &transform) const {
+        glm::vec4 clip[8];
+        for (int i = 0; i < 8; i++)
+            clip[i] = transform * glm::vec4(corner(i), 1.f);
+
+        for (int axis = 0; axis < 3; axis++) {
+            bool below = true, above = true;
+            for (auto &c: clip) {
+                below = below && c[axis] < -c.w;
+                above = above && c[axis] > c.w;
+            }
+            if (below || above)
+                return false;
+        }
+        return true;
+    }
 };
 
 class Object {
 public:
     std::vector<vertex> vertices;
     std::vector<std::uint32_t> indices;
+    // one per vertex for objects with a normal map, empty otherwise: xyz along increasing u, w the bitangent sign
+    std::vector<glm::vec4> tangents;
     mtl_object mtl;
-    texture *map_Ka, *map_Ks, *map_Kd, *norm;
+    bounding_box bounds;
+    texture *map_Ka = nullptr, *map_Ks = nullptr, *map_Kd = nullptr, *norm = nullptr;
     GLuint vao, vbo, ebo, tex, specular_map, diffuse_map, normal_map;
+    // attribute 3 of the unpacked layout, only when there are tangents
+    GLuint tangent_vbo = 0;
+    // GL_UNSIGNED_SHORT when the vertices fit, chosen by upload()
+    GLenum index_type = GL_UNSIGNED_INT;
+    // coarser levels of detail after indices, all of them in ebo one after another
+    std::vector<mesh_lod> lods;
+    std::vector<std::size_t> lod_offsets;
+    // clusters of indices for culling, built by load_obj; level 0 only
+    std::vector<meshlet> meshlets;
+    // last-use stamps of the bound textures in the TextureRegistry
+    std::vector<std::uint64_t *> texture_uses;
+    // filled by pack() when pack_vertices is set, uploaded instead of vertices
+    std::vector<packed_vertex> packed_vertices;
+    // position-only stream for the depth-only passes
+    GLuint depth_vao, depth_vbo;
+    // quantized positions (depth stream, packed_vertices) decode as position_offset + position * position_scale
+    glm::vec3 position_offset = glm::vec3(0.f), position_scale = glm::vec3(1.f);
     bool has_specular_map = false;
     bool has_diffuse_map = false;
     bool has_normal_map = false;
     bool has_texture = false;
+    // ShaderFlags of the program variant, chosen once at load time
+    std::uint32_t shader_flags = 0;
+    // id of map_Ka in the VirtualTextureSystem, 0 if it is not virtual
+    std::uint32_t virtual_texture = 0;
+
+    // store the depth stream as 16-bit normalized positions relative to the bounds instead of floats
+    static inline bool quantize_depth_stream = false;
+    // upload packed_vertex instead of vertex; the depth stream is then quantized the same way
+    static inline bool pack_vertices = false;
+    // draw only the meshlets that pass the MeshletCuller of the pass, if it has one
+    static inline bool cull_meshlets = true;
+    static inline MeshletCullStats meshlet_stats;
+
+    bool uploaded = false;
 
+    // Only fills the CPU side, so objects can be built on any thread; upload() creates the GL buffers.
     Object(std::vector<vertex> vertices, std::vector<std::uint32_t> indices, mtl_object mtl) {
-        this->vertices = vertices;
-        this->indices = indices;
-        this->mtl = mtl;
+        this->vertices = std::move(vertices);
+        this->indices = std::move(indices);
+        this->mtl = std::move(mtl);
+        for (vertex const &v: this->vertices)
+            bounds.extend(v.position);
+    }
+
+    // Fills packed_vertices; CPU only. Returns how far they are from vertices.
+    vertex_packing_error pack() {
+        fit_position_quantization();
+        vertex_packing_error error;
+        packed_vertices.clear();
+        packed_vertices.reserve(vertices.size());
+        for (std::size_t i = 0; i < vertices.size(); i++) {
+            vertex const &v = vertices[i];
+            glm::vec4 tangent = tangents.empty() ? glm::vec4(0.f) : tangents[i];
+            packed_vertices.push_back(pack_vertex(v.position, v.normal, tangent, v.texcoord, position_offset, position_scale, error));
+        }
+        return error;
+    }
 
+    void upload() {
         glGenVertexArrays(1, &vao);
         glBindVertexArray(vao);
 
         glGenBuffers(1, &vbo);
         glBindBuffer(GL_ARRAY_BUFFER, vbo);
-        glBufferData(GL_ARRAY_BUFFER, this->vertices.size() * sizeof(vertex), this->vertices.data(), GL_STATIC_DRAW);
+        if (!packed_vertices.empty())
+            glBufferData(GL_ARRAY_BUFFER, packed_vertices.size() * sizeof(packed_vertex), packed_vertices.data(), GL_STATIC_DRAW);
+        else
+            glBufferData(GL_ARRAY_BUFFER, this->vertices.size() * sizeof(vertex), this->vertices.data(), GL_STATIC_DRAW);
 
         glGenBuffers(1, &ebo);
         glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
-        glBufferData(GL_ELEMENT_ARRAY_BUFFER, this->indices.size() * sizeof(this->indices[0]), this->indices.data(), GL_STATIC_DRAW);
+        std::vector<std::uint32_t> all_indices = indices;
+        lod_offsets = {0};
+        for (mesh_lod const &lod: lods) {
+            lod_offsets.push_back(all_indices.size());
+            all_indices.insert(all_indices.end(), lod.indices.begin(), lod.indices.end());
+        }
+        if (vertices.size() <= short_index_vertex_limit) {
+            std::vector<std::uint16_t> short_indices(all_indices.begin(), all_indices.end());
+            glBufferData(GL_ELEMENT_ARRAY_BUFFER, short_indices.size() * sizeof(short_indices[0]), short_indices.data(), GL_STATIC_DRAW);
+            index_type = GL_UNSIGNED_SHORT;
+        } else {
+            glBufferData(GL_ELEMENT_ARRAY_BUFFER, all_indices.size() * sizeof(all_indices[0]), all_indices.data(), GL_STATIC_DRAW);
+            index_type = GL_UNSIGNED_INT;
+        }
 
         glEnableVertexAttribArray(0);
-        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(vertex), (void*)(0));
         glEnableVertexAttribArray(1);
-        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(vertex), (void*)(12));
         glEnableVertexAttribArray(2);
-        glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(vertex), (void*)(24));
+        // without tangents attribute 3 stays disabled; only the normal-mapped shader reads it
+        if (!tangents.empty())
+            glEnableVertexAttribArray(3);
+        if (!packed_vertices.empty()) {
+            glVertexAttribPointer(0, 3, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(packed_vertex), (void*)(0));
+            glVertexAttribPointer(1, 2, GL_SHORT, GL_TRUE, sizeof(packed_vertex), (void*)(8));
+            glVertexAttribPointer(2, 2, GL_HALF_FLOAT, GL_FALSE, sizeof(packed_vertex), (void*)(12));
+            // the tangent bits as an integer-valued float
+            if (!tangents.empty())
+                glVertexAttribPointer(3, 1, GL_UNSIGNED_SHORT, GL_FALSE, sizeof(packed_vertex), (void*)(6));
+        } else {
+            glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(vertex), (void*)(0));
+            glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(vertex), (void*)(12));
+            glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(vertex), (void*)(24));
+            if (!tangents.empty()) {
+                glGenBuffers(1, &tangent_vbo);
+                glBindBuffer(GL_ARRAY_BUFFER, tangent_vbo);
+                glBufferData(GL_ARRAY_BUFFER, tangents.size() * sizeof(tangents[0]), tangents.data(), GL_STATIC_DRAW);
+                glVertexAttribPointer(3, 4, GL_FLOAT, GL_FALSE, sizeof(tangents[0]), (void*)(0));
+            }
+        }
 
+        create_depth_stream();
+        uploaded = true;
     }
 
-    void load_textures(std::map<std::string, texture> &textures) {
+    void create_depth_stream() {
+        glGenVertexArrays(1, &depth_vao);
+        glBindVertexArray(depth_vao);
+
+        glGenBuffers(1, &depth_vbo);
+        glBindBuffer(GL_ARRAY_BUFFER, depth_vbo);
+        if (quantize_depth_stream || !packed_vertices.empty()) {
+            fit_position_quantization();
+
+            // padded to 4 components to keep every vertex 4-byte aligned
+            std::vector<std::uint16_t> positions(vertices.size() * 4, 0);
+            for (std::size_t i = 0; i < vertices.size(); i++) {
+                glm::vec3 p = (vertices[i].position - position_offset) / position_scale;
+                for (int c = 0; c < 3; c++)
+                    positions[i * 4 + c] = quantize_unorm16(p[c]);
+            }
+            glBufferData(GL_ARRAY_BUFFER, positions.size() * sizeof(positions[0]), positions.data(), GL_STATIC_DRAW);
+            glEnableVertexAttribArray(0);
+            glVertexAttribPointer(0, 3, GL_UNSIGNED_SHORT, GL_TRUE, 4 * sizeof(std::uint16_t), (void*)(0));
+        } else {
+            std::vector<glm::vec3> positions(vertices.size());
+            for (std::size_t i = 0; i < vertices.size(); i++)
+                positions[i] = vertices[i].position;
+            glBufferData(GL_ARRAY_BUFFER, positions.size() * sizeof(positions[0]), positions.data(), GL_STATIC_DRAW);
+            glEnableVertexAttribArray(0);
+            glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (void*)(0));
+        }
+
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
+    }
+
+    void fit_position_quantization() {
+        position_offset = bounds.min;
+        position_scale = glm::max(bounds.max - bounds.min, glm::vec3(std::numeric_limits<float>::min()));
+    }
+
+    // Resolves the material's texture maps; CPU only.
+    void bind_textures(std::map<std::string, texture> &textures) {
         if (mtl.map_Ka != "") {
             this->map_Ka = &textures[mtl.map_Ka];
             has_texture = true;
@@ -92,47 +261,61 @@ public:
             this->norm = &textures[mtl.norm];
             has_normal_map = true;
         }
-        if (has_texture)
-            load_texture(tex, map_Ka);
-        else
-            load_texture(tex, reinterpret_cast<texture *&>(textures.begin()->second));
+        // objects without an ambient map still sample tex, so they get some other texture of the model
+        if (!has_texture && !textures.empty())
+            this->map_Ka = &textures.begin()->second;
+    }
+
+    // Texture files shared with other objects are uploaded only once.
+    void upload_textures(TextureRegistry &registry) {
+        auto acquire = [&](texture const &source) {
+            GLuint name = registry.acquire(source);
+            texture_uses.push_back(registry.last_used(source));
+            return name;
+        };
+        if (map_Ka != nullptr)
+            tex = acquire(*map_Ka);
         if (has_specular_map)
-            load_texture(specular_map, map_Ks);
+            specular_map = acquire(*map_Ks);
         if (has_diffuse_map)
-            load_texture(diffuse_map, map_Kd);
+            diffuse_map = acquire(*map_Kd);
         if (has_normal_map)
-            load_texture(normal_map, norm);
+            normal_map = acquire(*norm);
     }
 
-    void load_texture(GLuint &t, texture* &tex_src) {
-        glGenTextures(1, &t);
-        glBindTexture(GL_TEXTURE_2D, t);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-        GLenum format;
-        GLint internal_format;
-        if (tex_src->channels == 4) {
-            format = GL_RGBA;
-            internal_format = GL_RGBA8;
-        }
-        if (tex_src->channels == 3) {
-            format = GL_RGB;
-            internal_format = GL_RGB8;
-        }
-        if (tex_src->channels == 2) {
-            format = GL_RG;
-            internal_format = GL_RG8;
-        }
-        if (tex_src->channels == 1) {
-            format = GL_DEPTH_COMPONENT;
-            internal_format = GL_DEPTH_COMPONENT24;
+    std::size_t lod_index_count(std::size_t level) const {
+        return level == 0 ? indices.size() : lods[level - 1].indices.size();
+    }
+
+    // The coarsest level whose error covers at most max_pixel_error pixels when transform maps the object to clip
+    // space and the viewport is pixels high; 0 if the camera is within the bounds.
+    int select_lod(glm::mat4 const &transform, float pixels, float max_pixel_error) const {
+        if (lods.empty())
+            return 0;
+        glm::vec3 center = (bounds.min + bounds.max) * 0.5f;
+        float radius = glm::length(bounds.max - bounds.min) * 0.5f;
+        glm::vec3 row_y(transform[0][1], transform[1][1], transform[2][1]);
+        glm::vec3 row_w(transform[0][3], transform[1][3], transform[2][3]);
+        // w of the nearest point of the bounding sphere
+        float w = (transform * glm::vec4(center, 1.f)).w - radius * glm::length(row_w);
+        if (w <= 0.f)
+            return 0;
+        float pixels_per_unit = glm::length(row_y) * pixels * 0.5f / w;
+
+        int level = 0;
+        for (std::size_t i = 0; i < lods.size(); i++) {
+            if (lods[i].error * pixels_per_unit <= max_pixel_error)
+                level = int(i) + 1;
         }
-        glTexImage2D(GL_TEXTURE_2D, 0, internal_format, tex_src->width, tex_src->height, 0,
-                     format, GL_UNSIGNED_BYTE, tex_src->data.data());
-        glGenerateMipmap(GL_TEXTURE_2D);
+        return level;
+    }
+
+    // objects with an RGBA ambient map are alpha blended and have to be drawn after the opaque ones
+    bool is_transparent() const {
+        return has_texture && map_Ka->channels == 4;
     }
 
-    void render() {
+    void render(int lod = 0, MeshletCuller const *culler = nullptr) {
         glActiveTexture(GL_TEXTURE0 + 1);
         glBindTexture(GL_TEXTURE_2D, tex);
 
@@ -148,10 +331,51 @@ public:
             glActiveTexture(GL_TEXTURE0 + 4);
             glBindTexture(GL_TEXTURE_2D, normal_map);
         }
+        for (std::uint64_t *last_used: texture_uses)
+            *last_used = TextureRegistry::frame;
 
         glBindVertexArray(vao);
-        glDrawElements(GL_TRIANGLES, indices.size(), GL_UNSIGNED_INT, nullptr);
+        draw_elements(lod, culler);
+    }
+
+    void render_depth(int lod = 0, MeshletCuller const *culler = nullptr) {
+        glBindVertexArray(depth_vao);
+        draw_elements(lod, culler);
     }
+
+    // With a culler, the visible meshlets go out as one multi-draw of index ranges, adjacent ones merged.
+    void draw_elements(int lod, MeshletCuller const *culler) {
+        std::size_t index_size = index_type == GL_UNSIGNED_SHORT ? 2 : 4;
+        if (culler == nullptr || !cull_meshlets || lod != 0 || meshlets.empty()) {
+            meshlet_stats.triangles += lod_index_count(lod) / 3;
+            glDrawElements(GL_TRIANGLES, lod_index_count(lod), index_type, (void*)(lod_offsets[lod] * index_size));
+            return;
+        }
+
+        draw_counts.clear();
+        draw_offsets.clear();
+        std::size_t end = 0;
+        for (meshlet const &m: meshlets) {
+            meshlet_stats.tested++;
+            if (!culler->visible(m, meshlet_stats))
+                continue;
+            meshlet_stats.triangles += m.index_count / 3;
+            if (!draw_counts.empty() && end == m.index_offset) {
+                draw_counts.back() += GLsizei(m.index_count);
+            } else {
+                draw_counts.push_back(GLsizei(m.index_count));
+                draw_offsets.push_back((void*)(m.index_offset * index_size));
+            }
+            end = m.index_offset + m.index_count;
+        }
+        if (!draw_counts.empty())
+            glMultiDrawElements(GL_TRIANGLES, draw_counts.data(), index_type, draw_offsets.data(), GLsizei(draw_counts.size()));
+    }
+
+private:
+    // scratch for draw_elements, kept to avoid allocating every frame
+    std::vector<GLsizei> draw_counts;
+    std::vector<const void *> draw_offsets;
 };
 
 
@@ -2,16 +2,134 @@
 #define SPONZA_SCENE_PARSER_H
 
 
-#include <set>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <future>
+#include <iostream>
+#include <string_view>
+#include <thread>
+#include "AssetCache.h"
+#include "BlockCompression.h"
+#include "MeshLod.h"
+#include "MeshOptimizer.h"
+#include "Mipmaps.h"
+#include "Normals.h"
+#include "Tangents.h"
+
+// What a first pass over an OBJ finds, so that the second one reserves everything at its final size.
+struct obj_counts {
+    std::size_t positions = 0, texture_coords = 0, normals = 0;
+    // triangle corners and distinct corners of every material, in the order of the usemtl lines; the first one is
+    // for the faces before any
+    std::vector<std::size_t> material_corners = {0}, material_vertices;
+    bool missing_normals = false;
+};
+
+// Numbers the distinct combinations of v, vt and vn indices of OBJ corners in the order they come.
+class CornerIndex {
+private:
+    // the indices of every number, and open addressing over them with the number + 1 in a slot, 0 if it is empty:
+    // a std::map node per corner would take more memory than the vertex it stands for
+    std::vector<std::array<std::uint32_t, 3>> keys;
+    std::vector<std::uint32_t> slots = std::vector<std::uint32_t>(1024, 0);
+
+    std::uint32_t &find(std::uint32_t const corner[3]) {
+        std::uint32_t hash = corner[0] * 0x9e3779b1u ^ corner[1] * 0x85ebca77u ^ corner[2] * 0xc2b2ae3du;
+        hash ^= hash >> 16;
+        for (std::size_t i = hash & (slots.size() - 1);; i = (i + 1) & (slots.size() - 1)) {
+            std::uint32_t &slot = slots[i];
+            if (slot == 0 || std::equal(corner, corner + 3, keys[slot - 1].begin()))
+                return slot;
+        }
+    }
+
+public:
+    // Makes room for count numbers, so that the slots are allocated only once.
+    void reserve(std::size_t count) {
+        keys.reserve(count);
+        std::size_t size = slots.size();
+        while (size < count * 2)
+            size *= 2;
+        if (size == slots.size())
+            return;
+        slots.assign(size, 0);
+        slots.shrink_to_fit();
+        for (std::size_t number = 0; number < keys.size(); number++)
+            find(keys[number].data()) = std::uint32_t(number + 1);
+    }
+
+    // The number of corner, which is size() - 1 if it is new.
+    std::uint32_t insert(std::uint32_t const corner[3]) {
+        if ((keys.size() + 1) * 2 > slots.size())
+            reserve(keys.size() + 1);
+        std::uint32_t &slot = find(corner);
+        if (slot == 0) {
+            keys.push_back({corner[0], corner[1], corner[2]});
+            slot = std::uint32_t(keys.size());
+        }
+        return slot - 1;
+    }
+
+    std::size_t size() const {
+        return keys.size();
+    }
+
+    void clear() {
+        keys = std::vector<std::array<std::uint32_t, 3>>();
+        slots.assign(1024, 0);
+        slots.shrink_to_fit();
+    }
+};
+
+// Makes one object of OBJ corners, one vertex per distinct corner.
+class ObjectBuilder {
+private:
+    CornerIndex corners;
+
+public:
+    std::vector<vertex> vertices;
+    std::vector<std::uint32_t> indices;
+
+    void reserve(std::size_t vertex_count, std::size_t index_count) {
+        corners.reserve(vertex_count);
+        vertices.reserve(vertex_count);
+        indices.reserve(index_count);
+    }
+
+    // corner has the v, vt and vn index, the last two possibly Parser::missing_index
+    void add(std::uint32_t const corner[3], std::vector<glm::vec3> const &positions,
+             std::vector<glm::vec2> const &texture_coords, std::vector<glm::vec3> const &normals) {
+        std::uint32_t index = corners.insert(corner);
+        if (index == vertices.size()) {
+            vertex v = {positions[corner[0]], glm::vec3(0.f), glm::vec2(0.f)};
+            if (corner[1] < texture_coords.size())
+                v.texcoord = texture_coords[corner[1]];
+            if (corner[2] < normals.size())
+                v.normal = normals[corner[2]];
+            vertices.push_back(v);
+        }
+        indices.push_back(index);
+    }
+
+    // Hands the vertices and indices over to an object and starts the next one.
+    Object finish(mtl_object const &mtl) {
+        vertices.shrink_to_fit();
+        Object object(std::move(vertices), std::move(indices), mtl);
+        vertices = {};
+        indices = {};
+        corners.clear();
+        return object;
+    }
+};
 
 class Parser {
 public:
-    static std::pair<std::map<std::string, mtl_object>, std::map<std::string, texture>> load_mtl(std::istream &input) {
+    static std::map<std::string, mtl_object> load_mtl(std::istream &input) {
         mtl_object obj;
         obj.name = "__";
 
         std::map<std::string, mtl_object> m;
-        std::set<std::string> paths;
 
         for (std::string line; std::getline(input, line);) {
             std::istringstream line_stream(line);
@@ -79,25 +197,21 @@ public:
 
             if (type == "map_Ka") {
                 line_stream >> obj.map_Ka;
-                paths.insert(obj.map_Ka);
                 continue;
             }
 
             if (type == "map_Kd") {
                 line_stream >> obj.map_Kd;
-                paths.insert(obj.map_Kd);
                 continue;
             }
 
             if (type == "map_Ks") {
                 line_stream >> obj.map_Ks;
-                paths.insert(obj.map_Ks);
                 continue;
             }
 
             if (type == "norm") {
                 line_stream >> obj.norm;
-                paths.insert(obj.norm);
                 continue;
             }
 
@@ -106,172 +220,615 @@ public:
             }
         }
 
-        std::map<std::string, texture> textures;
-        for (auto &path: paths) {
-            std::string filename = (PRACTICE_SOURCE_DIRECTORY "/sponza/" + std::regex_replace(path, std::regex("\\\\"), "/"));
-            texture t;
-            unsigned char *pixels = stbi_load(filename.c_str(),
-                                              &t.width, &t.height, &t.channels, 0);
-            t.data.resize(t.width * t.height * t.channels);
-            t.data.assign(pixels, pixels + t.width * t.height * t.channels);
-            textures.insert({path, t});
-        }
         m.insert({obj.name, obj});
 
-        return {m, textures};
+        return m;
     };
 
-    static std::vector<Object> load_obj(std::istream & input, std::map<std::string, mtl_object> &m, float scale_factor = 1500)
-    {
-        std::vector<vertex> vertices;
-        std::vector<vertex> vertices_normals;
-        std::vector<vertex> vertices_texture_coords;
-        std::vector<std::uint32_t> indices;
-        std::vector<std::uint32_t> indices_normals;
-        std::vector<std::uint32_t> indices_texture_coords;
-        std::vector<Object> objects;
-        mtl_object cur_mtl;
+    // Where the texture a material names is on disk.
+    static std::string texture_filename(std::string const &path) {
+        return PRACTICE_SOURCE_DIRECTORY "/sponza/" + std::regex_replace(path, std::regex("\\\\"), "/");
+    }
 
-        for (std::string line; std::getline(input, line);)
-        {
-            std::istringstream line_stream(line);
+    // Whether the objects of mtl are alpha blended, as Object::is_transparent decides once the textures are decoded:
+    // by an RGBA ambient map, whose channels are read from the file header only.
+    static bool is_transparent(mtl_object const &mtl) {
+        int width, height, channels = 0;
+        return mtl.map_Ka != "" && stbi_info(texture_filename(mtl.map_Ka).c_str(), &width, &height, &channels)
+               && channels == 4;
+    }
 
-            std::string type;
-            line_stream >> type;
+    // Decodes every texture referenced by the materials, one worker thread per texture.
+    static std::map<std::string, texture> load_textures(std::map<std::string, mtl_object> const &m) {
+        std::map<std::string, TextureUsage> paths;
+        for (auto &[name, obj]: m) {
+            for (auto [path, usage]: {std::pair{obj.map_Ka, TEXTURE_COLOR}, std::pair{obj.map_Kd, TEXTURE_COLOR},
+                                      std::pair{obj.map_Ks, TEXTURE_DATA}, std::pair{obj.norm, TEXTURE_NORMAL}}) {
+                if (path != "")
+                    paths[path] = std::max(paths[path], usage);
+            }
+        }
+
+        // one thread per texture decodes it, builds its mip chain and compresses it, unless all that is baked already
+        std::vector<std::pair<std::string, std::future<texture>>> decoded;
+        for (auto &[path, usage]: paths) {
+            decoded.emplace_back(path, std::async(std::launch::async, [path, usage] {
+                std::string filename = texture_filename(path);
+                texture t;
+                t.path = filename;
+                auto cached = asset_cache_path(filename, std::string(compress_textures ? "mips bc" : "mips raw")
+                                                          + " usage " + std::to_string(usage));
+                if (load_cached_texture(cached, t))
+                    return t;
+
+                unsigned char *pixels = stbi_load(filename.c_str(),
+                                                  &t.width, &t.height, &t.channels, 0);
+                if (pixels == nullptr)
+                    throw std::runtime_error("Texture loading failed: " + filename);
+                t.srgb = usage == TEXTURE_COLOR;
+                t.levels.emplace_back(pixels, pixels + t.width * t.height * t.channels);
+                stbi_image_free(pixels);
+                generate_mipmaps(t);
+                if (compress_textures)
+                    compress_texture(t, block_encoding(t.channels, usage));
+                save_cached_texture(cached, t);
+                return t;
+            }));
+        }
+
+        std::map<std::string, texture> textures;
+        for (auto &[path, t]: decoded)
+            textures.insert({path, t.get()});
+        return textures;
+    }
+
+    // Tangents for the objects with a normal map, read from the asset cache when obj_path is given and they are
+    // baked already; load_obj runs this on the objects as parsed, before anything reorders them.
+    static void build_tangents(std::vector<Object> &objects, std::filesystem::path const &obj_path) {
+        auto start = std::chrono::high_resolution_clock::now();
+        std::vector<tangent_mesh_size> sizes;
+        for (Object const &object: objects)
+            sizes.emplace_back(object.vertices.size(), object.indices.size());
+        std::filesystem::path cached = obj_path.empty() ? obj_path : asset_cache_path(obj_path, "tangents");
+
+        std::vector<tangent_space> spaces;
+        bool baked = !cached.empty() && load_cached_tangents(cached, sizes, spaces);
+        if (!baked) {
+            spaces.assign(objects.size(), {});
+            for (std::size_t i = 0; i < objects.size(); i++)
+                if (objects[i].mtl.norm != "")
+                    spaces[i] = generate_tangents(objects[i].vertices, objects[i].indices);
+            if (!cached.empty())
+                save_cached_tangents(cached, sizes, spaces);
+        }
 
-            if (type == "#")
+        std::size_t object_count = 0, split_count = 0;
+        for (std::size_t i = 0; i < objects.size(); i++) {
+            object_count += !spaces[i].tangents.empty();
+            split_count += spaces[i].split_sources.size();
+            apply_tangent_space(objects[i].vertices, objects[i].indices, objects[i].tangents, std::move(spaces[i]));
+        }
+        if (object_count == 0)
+            return;
+
+        std::ostringstream report;
+        report << "Tangents of " << object_count << " objects" << (baked ? " loaded" : " built") << " in "
+               << std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count()
+               << " ms, " << split_count << " vertices split for mirrored texture coordinates\n";
+        std::cout << report.str() << std::flush;
+    }
+
+    // Reorders the triangles of every object for the vertex cache and, unless it is alpha blended and its triangle
+    // order decides how it composites, for overdraw; then its vertices for fetch locality. Prints the cache
+    // statistics before and after, in one piece, as models load on several threads.
+    static void optimize_objects(std::vector<Object> &objects) {
+        std::ostringstream report;
+        report << std::fixed << std::setprecision(3);
+        std::size_t triangles = 0, before = 0, after = 0;
+        for (Object &object: objects) {
+            if (object.indices.empty())
                 continue;
+            auto old_statistics = analyze_vertex_cache(object.indices, object.vertices.size());
+            optimize_vertex_cache(object.indices, object.vertices.size());
+            if (!is_transparent(object.mtl))
+                optimize_overdraw(object.indices, object.vertices);
+            auto sources = optimize_vertex_fetch(object.vertices, object.indices);
+            if (!object.tangents.empty()) {
+                std::vector<glm::vec4> tangents;
+                tangents.reserve(sources.size());
+                for (std::uint32_t v: sources)
+                    tangents.push_back(object.tangents[v]);
+                object.tangents = std::move(tangents);
+            }
+            auto new_statistics = analyze_vertex_cache(object.indices, object.vertices.size());
+
+            std::size_t count = object.indices.size() / 3;
+            triangles += count;
+            before += std::size_t(std::lround(old_statistics.acmr * count));
+            after += std::size_t(std::lround(new_statistics.acmr * count));
+            report << "  " << object.mtl.name << ": " << count << " triangles, ACMR " << old_statistics.acmr << " -> "
+                   << new_statistics.acmr << ", ATVR " << old_statistics.atvr << " -> " << new_statistics.atvr << "\n";
+        }
+        if (triangles > 0)
+            report << "Vertex cache: ACMR " << float(before) / triangles << " -> " << float(after) / triangles
+                   << " over " << triangles << " triangles\n";
+        std::cout << report.str() << std::flush;
+    }
 
-            if (type == "v")
-            {
-                vertex v;
-                line_stream >> v.position.x >> v.position.y >> v.position.z;
-                v.position.x /= scale_factor;
-                v.position.y /= scale_factor;
-                v.position.z /= scale_factor;
-                vertices.push_back(v);
+    // Cuts objects with more vertices than 16-bit indices address into pieces in triangle order, each with the
+    // vertices it uses, and prints the size of the index buffers.
+    static void split_objects(std::vector<Object> &objects) {
+        const std::uint32_t unused = ~0u;
+        std::vector<Object> result;
+        std::size_t index_count = 0, index_bytes = 0;
+        for (Object &object: objects) {
+            if (object.vertices.size() <= short_index_vertex_limit) {
+                result.push_back(std::move(object));
                 continue;
             }
+            std::vector<std::uint32_t> remap(object.vertices.size(), unused);
+            std::vector<vertex> vertices;
+            std::vector<std::uint32_t> indices;
+            std::vector<glm::vec4> tangents;
+            // copied out at their exact size, the buffers are reused for the next piece
+            auto emit = [&]() {
+                result.emplace_back(std::vector<vertex>(vertices.begin(), vertices.end()),
+                                    std::vector<std::uint32_t>(indices.begin(), indices.end()), object.mtl);
+                result.back().tangents.assign(tangents.begin(), tangents.end());
+                std::fill(remap.begin(), remap.end(), unused);
+                vertices.clear();
+                indices.clear();
+                tangents.clear();
+            };
+            for (std::size_t i = 0; i < object.indices.size(); i += 3) {
+                std::size_t added = 0;
+                for (int k = 0; k < 3; k++)
+                    added += remap[object.indices[i + k]] == unused;
+                if (vertices.size() + added > short_index_vertex_limit)
+                    emit();
+                for (int k = 0; k < 3; k++) {
+                    std::uint32_t &index = remap[object.indices[i + k]];
+                    if (index == unused) {
+                        index = std::uint32_t(vertices.size());
+                        vertices.push_back(object.vertices[object.indices[i + k]]);
+                        if (!object.tangents.empty())
+                            tangents.push_back(object.tangents[object.indices[i + k]]);
+                    }
+                    indices.push_back(index);
+                }
+            }
+            emit();
+            // released right away, so that only one object is held twice; assigning {} would keep the capacity
+            object.vertices = std::vector<vertex>();
+            object.indices = std::vector<std::uint32_t>();
+            object.tangents = std::vector<glm::vec4>();
+        }
+        objects = std::move(result);
+
+        for (Object const &object: objects) {
+            index_count += object.indices.size();
+            index_bytes += object.indices.size() * (object.vertices.size() <= short_index_vertex_limit ? 2 : 4);
+        }
+        std::cout << "Index buffers: " << index_bytes / 1024 << " KB instead of " << index_count * 4 / 1024 << " KB"
+                  << std::endl;
+    }
+
+    // Partitions an object into meshlets, which reorders its triangles. With optimize_meshes, the triangles of each
+    // meshlet are then ordered for the vertex cache again.
+    static void cluster_object(Object &object) {
+        object.meshlets = build_meshlets(object.vertices, object.indices);
+        if (!optimize_meshes)
+            return;
+        for (meshlet const &m: object.meshlets) {
+            // in local vertex numbers, as a meshlet uses at most meshlet_max_vertices
+            auto range = object.indices.begin() + m.index_offset;
+            std::vector<std::uint32_t> global, local(range, range + m.index_count);
+            for (std::uint32_t &index: local) {
+                auto found = std::find(global.begin(), global.end(), index);
+                if (found == global.end())
+                    found = global.insert(global.end(), index);
+                index = std::uint32_t(found - global.begin());
+            }
+            optimize_vertex_cache(local, global.size());
+            for (std::size_t i = 0; i < local.size(); i++)
+                range[i] = global[local[i]];
+        }
+    }
+
+    // Runs cluster_object on every object and prints how full the meshlets are.
+    static void cluster_objects(std::vector<Object> &objects) {
+        std::size_t meshlet_count = 0, triangles = 0, never_back_facing = 0, misses = 0;
+        for (Object &object: objects) {
+            cluster_object(object);
+            meshlet_count += object.meshlets.size();
+            triangles += object.indices.size() / 3;
+            for (meshlet const &m: object.meshlets)
+                never_back_facing += m.cone_sin > 1.f;
+            if (optimize_meshes && !object.indices.empty())
+                misses += std::size_t(std::lround(analyze_vertex_cache(object.indices, object.vertices.size()).acmr
+                                                  * object.indices.size() / 3));
+        }
+
+        std::ostringstream report;
+        report << std::fixed << std::setprecision(1) << "Meshlets: " << meshlet_count << ", "
+               << (meshlet_count > 0 ? float(triangles) / meshlet_count : 0.f) << " triangles on average, "
+               << never_back_facing << " without a normal cone";
+        if (optimize_meshes && triangles > 0)
+            report << std::setprecision(3) << ", ACMR " << float(misses) / triangles << " after clustering";
+        report << "\n";
+        std::cout << report.str() << std::flush;
+    }
+
+    // Levels of detail for every object, simplified on all cores unless they are baked already for obj_path. The
+    // objects must be exactly as load_obj returned them with the same options.
+    static void build_lods(std::vector<Object> &objects, std::filesystem::path const &obj_path, float scale_factor) {
+        auto start = std::chrono::high_resolution_clock::now();
+        std::vector<lod_mesh_size> sizes;
+        for (Object const &object: objects)
+            sizes.emplace_back(object.vertices.size(), object.indices.size());
+        // the errors are baked in OBJ units, but the vertex numbers the levels refer to come out of the overdraw
+        // sort, whose keys are scaled positions, so the scale is part of the key
+        std::string options = std::string(optimize_meshes ? "lods optimized" : "lods") + " scale "
+                              + std::to_string(scale_factor);
+        auto cached = asset_cache_path(obj_path, options);
+
+        std::vector<std::vector<mesh_lod>> lods;
+        bool baked = load_cached_lods(cached, sizes, lods);
+        if (baked) {
+            for (auto &object_lods: lods)
+                for (mesh_lod &lod: object_lods)
+                    lod.error /= scale_factor;
+        } else {
+            lods.assign(objects.size(), {});
+            std::atomic<std::size_t> next = 0;
+            std::vector<std::future<void>> workers;
+            for (unsigned i = 0; i < std::max(1u, std::thread::hardware_concurrency()); i++)
+                workers.push_back(std::async(std::launch::async, [&] {
+                    for (std::size_t object; (object = next++) < objects.size();)
+                        lods[object] = generate_lods(objects[object].vertices, objects[object].indices);
+                }));
+            for (auto &worker: workers)
+                worker.get();
+
+            auto unscaled = lods;
+            for (auto &object_lods: unscaled)
+                for (mesh_lod &lod: object_lods)
+                    lod.error *= scale_factor;
+            save_cached_lods(cached, sizes, unscaled);
+        }
+
+        std::vector<std::size_t> triangles;
+        for (std::size_t i = 0; i < objects.size(); i++) {
+            objects[i].lods = std::move(lods[i]);
+            for (std::size_t level = 0; level <= objects[i].lods.size(); level++) {
+                if (triangles.size() <= level)
+                    triangles.push_back(0);
+                triangles[level] += objects[i].lod_index_count(level) / 3;
+            }
+        }
+
+        std::ostringstream report;
+        report << "LODs of " << obj_path.filename().string() << (baked ? " loaded" : " built") << " in "
+               << std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count()
+               << " ms, triangles per level:";
+        for (std::size_t count: triangles)
+            report << " " << count;
+        std::cout << report.str() << std::endl;
+    }
+
+    // Packs the vertices of every object and prints the largest error against the float vertices.
+    static void pack_objects(std::vector<Object> &objects) {
+        vertex_packing_error error;
+        std::size_t vertex_count = 0, float_bytes = 0;
+        float relative_position_error = 0.f;
+        for (Object &object: objects) {
+            auto object_error = object.pack();
+            error.extend(object_error);
+            vertex_count += object.vertices.size();
+            float_bytes += object.vertices.size() * sizeof(vertex) + object.tangents.size() * sizeof(glm::vec4);
+            float extent = std::max({object.position_scale.x, object.position_scale.y, object.position_scale.z});
+            relative_position_error = std::max(relative_position_error, object_error.position / extent);
+        }
+
+        std::ostringstream report;
+        report << "Packed vertices: " << vertex_count * sizeof(packed_vertex) / 1024 << " KB instead of "
+               << float_bytes / 1024 << " KB, largest error: position " << error.position
+               << " (" << relative_position_error << " of the object size), normal " << error.normal
+               << " degrees, tangent " << error.tangent << " degrees, texcoord " << error.texcoord << "\n";
+        std::cout << report.str() << std::flush;
+    }
+
+    // component of a face vertex that the face doesn't give
+    static constexpr std::uint32_t missing_index = ~0u;
+
+    // Parses the next face vertex of text (v, v/vt, v//vn or v/vt/vn) and advances past it. The indices are made
+    // zero-based against counts, the numbers of v, vt and vn elements read so far, which negative indices count back
+    // from. Returns false at the end of the line; throws on malformed or out-of-range indices.
+    static bool parse_face_vertex(std::string_view &text, std::size_t const counts[3], std::uint32_t result[3]) {
+        auto is_space = [](char c) {
+            return c == ' ' || c == '\t' || c == '\r';
+        };
+        std::size_t start = 0;
+        while (start < text.size() && is_space(text[start]))
+            start++;
+        if (start == text.size())
+            return false;
+        text.remove_prefix(start);
+        auto fail = [&]() {
+            std::string token(text.begin(), std::find_if(text.begin(), text.end(), is_space));
+            return std::runtime_error("Invalid OBJ face vertex: " + token);
+        };
+
+        const char *p = text.data(), *end = text.data() + text.size();
+        result[0] = result[1] = result[2] = missing_index;
+        for (int component = 0; component < 3; component++) {
+            if (p != end && *p != '/' && !is_space(*p)) {
+                long long value = 0;
+                // from_chars takes a minus but no plus, which mustn't let a second sign through
+                const char *digits = p + (*p == '+');
+                auto [next, error] = std::from_chars(digits, end, value);
+                if (error != std::errc() || (digits != p && *digits == '-') || value == 0
+                    || value > (long long)counts[component] || value < -(long long)counts[component])
+                    throw fail();
+                result[component] = std::uint32_t(value > 0 ? value - 1 : (long long)counts[component] + value);
+                p = next;
+            }
+            if (p == end || *p != '/' || component == 2)
+                break;
+            p++;
+        }
+        if (result[0] == missing_index || (p != end && !is_space(*p)))
+            throw fail();
+        text.remove_prefix(p - text.data());
+        return true;
+    }
+
+    // Calls triangle(a, b, c) with the v, vt and vn indices of the corners of every triangle of the face vertices in
+    // text, a fan around the first one.
+    template <typename Triangle>
+    static void parse_face(std::string_view text, std::size_t const counts[3], Triangle const &triangle) {
+        std::string_view rest = text;
+        std::uint32_t first[3], previous[3], current[3];
+        std::size_t corner = 0;
+        for (; parse_face_vertex(rest, counts, current); corner++) {
+            if (corner == 0)
+                std::copy(current, current + 3, first);
+            if (corner >= 2)
+                triangle(first, previous, current);
+            std::copy(current, current + 3, previous);
+        }
+        if (corner < 3)
+            throw std::runtime_error("OBJ face with fewer than 3 vertices: f" + std::string(text));
+    }
+
+    // Splits the keyword off an OBJ line and leaves its arguments in line.
+    static std::string_view obj_keyword(std::string_view &line) {
+        std::size_t begin = line.find_first_not_of(" \t\r");
+        if (begin == std::string_view::npos) {
+            line = {};
+            return {};
+        }
+        std::size_t end = std::min(line.find_first_of(" \t\r", begin), line.size());
+        std::string_view keyword = line.substr(begin, end - begin);
+        line.remove_prefix(end);
+        return keyword;
+    }
 
-            if (type == "vn"){
-                vertex v;
-                line_stream >> v.position.x >> v.position.y >> v.position.z;
-                vertices_normals.push_back(v);
+    // Parses up to count numbers of text into result; the ones that text doesn't have are left as they are.
+    static void parse_floats(std::string_view text, float *result, int count) {
+        const char *p = text.data(), *end = text.data() + text.size();
+        for (int i = 0; i < count; i++) {
+            while (p != end && (*p == ' ' || *p == '\t' || *p == '\r'))
+                p++;
+            if (p == end)
+                return;
+            auto [next, error] = std::from_chars(p + (*p == '+'), end, result[i]);
+            if (error == std::errc::result_out_of_range)
+                result[i] = std::strtof(std::string(p, next).c_str(), nullptr);
+            else if (error != std::errc())
+                throw std::runtime_error("Invalid OBJ number: " + std::string(text));
+            p = next;
+        }
+    }
+
+    // The first pass of read_obj: counts the elements, and the corners and vertices of every material, and checks
+    // the faces, without keeping any of them.
+    static obj_counts count_obj(std::istream &input) {
+        obj_counts counts;
+        CornerIndex corners;
+        for (std::string line; std::getline(input, line);) {
+            std::string_view arguments(line);
+            std::string_view keyword = obj_keyword(arguments);
+            if (keyword == "v") {
+                counts.positions++;
+            } else if (keyword == "vt") {
+                counts.texture_coords++;
+            } else if (keyword == "vn") {
+                counts.normals++;
+            } else if (keyword == "f") {
+                std::size_t element_counts[3] = {counts.positions, counts.texture_coords, counts.normals};
+                parse_face(arguments, element_counts, [&](std::uint32_t const *a, std::uint32_t const *b,
+                                                          std::uint32_t const *c) {
+                    counts.material_corners.back() += 3;
+                    for (std::uint32_t const *v: {a, b, c}) {
+                        corners.insert(v);
+                        counts.missing_normals |= v[2] == missing_index;
+                    }
+                });
+            } else if (keyword == "usemtl" && counts.material_corners.back() != 0) {
+                counts.material_corners.push_back(0);
+                counts.material_vertices.push_back(corners.size());
+                corners.clear();
+            }
+        }
+        counts.material_vertices.push_back(corners.size());
+        return counts;
+    }
+
+    // Reads the objects of an OBJ as they are in the file, one per usemtl. Seekable input is read twice: the first
+    // pass counts everything, so that the second one fills exactly reserved element arrays and, unless normals have
+    // to be generated, which needs all faces at once, makes the objects straight from the lines. Memory then peaks
+    // at the elements plus the objects, instead of also holding every corner of the file.
+    static std::vector<Object> read_obj(std::istream &input, std::map<std::string, mtl_object> &m, float scale_factor) {
+        obj_counts counts;
+        auto input_start = input.tellg();
+        bool counted = input_start != std::streampos(-1);
+        if (counted) {
+            counts = count_obj(input);
+            input.clear();
+            input.seekg(input_start);
+        }
+        bool direct = counted && !counts.missing_normals;
+
+        std::vector<glm::vec3> positions, normals;
+        std::vector<glm::vec2> texture_coords;
+        positions.reserve(counts.positions);
+        normals.reserve(counts.normals);
+        texture_coords.reserve(counts.texture_coords);
+        // the corners of the whole file, only kept if normals are generated
+        std::vector<std::uint32_t> indices, indices_texture_coords, indices_normals;
+        // smoothing group of every triangle, 0 for "s off"
+        std::vector<std::uint32_t> face_groups;
+        std::uint32_t cur_group = 0;
+        if (!direct) {
+            std::size_t total = 0;
+            for (std::size_t corners: counts.material_corners)
+                total += corners;
+            for (auto *corner_indices: {&indices, &indices_texture_coords, &indices_normals})
+                corner_indices->reserve(total);
+            face_groups.reserve(total / 3);
+        }
+
+        // the corner each material starts at
+        std::vector<std::pair<std::size_t, mtl_object>> materials = {{0, mtl_object()}};
+        std::size_t corner_count = 0;
+        std::vector<Object> objects;
+        objects.reserve(counts.material_corners.size());
+        ObjectBuilder builder;
+        auto reserve_object = [&](std::size_t material) {
+            if (!direct)
+                return;
+            builder.reserve(counts.material_vertices[material], counts.material_corners[material]);
+        };
+        reserve_object(0);
+
+        for (std::string line; std::getline(input, line);) {
+            std::string_view arguments(line);
+            std::string_view keyword = obj_keyword(arguments);
+
+            // faces are most of a file, so they are parsed in place, without a stream or any allocation
+            if (keyword == "f") {
+                std::size_t element_counts[3] = {positions.size(), texture_coords.size(), normals.size()};
+                parse_face(arguments, element_counts, [&](std::uint32_t const *a, std::uint32_t const *b,
+                                                          std::uint32_t const *c) {
+                    corner_count += 3;
+                    if (direct) {
+                        for (std::uint32_t const *v: {a, b, c})
+                            builder.add(v, positions, texture_coords, normals);
+                        return;
+                    }
+                    for (std::uint32_t const *v: {a, b, c}) {
+                        indices.push_back(v[0]);
+                        indices_texture_coords.push_back(v[1]);
+                        indices_normals.push_back(v[2]);
+                    }
+                    face_groups.push_back(cur_group);
+                });
                 continue;
             }
 
-            if (type == "vt"){
-                vertex v;
-                line_stream >> v.position.x >> v.position.y >> v.position.z;
-                vertices_texture_coords.push_back(v);
+            if (keyword == "v") {
+                glm::vec3 position(0.f);
+                parse_floats(arguments, &position.x, 3);
+                positions.push_back(position / scale_factor);
                 continue;
             }
 
-            if (type == "s" || type.empty() || type == "g" || type == "mtllib" || type == "o" || type == "l")
+            if (keyword == "vn") {
+                glm::vec3 normal(0.f);
+                parse_floats(arguments, &normal.x, 3);
+                normals.push_back(normal);
                 continue;
+            }
 
-            if (type == "usemtl") {
-                std::string mtl_name;
-                line_stream >> mtl_name;
-                if (indices.empty()) {
-                    cur_mtl = m[mtl_name];
-                    continue;
-                }
-                std::vector<vertex> cur_vertices;
-                std::vector<vertex> cur_vertices_normals;
-                std::vector<vertex> cur_vertices_texture_coords;
-                std::vector<std::uint32_t> cur_indices;
-                std::vector<std::uint32_t> cur_indices_normals;
-                std::vector<std::uint32_t> cur_indices_texture_coords;
-
-                std::uint32_t cur = 0;
-                std::map<std::tuple<int, int, int>, std::uint32_t> check_map;
-
-                for (int i = 0; i < indices.size(); i++) {
-                    if (check_map.contains({indices[i], indices_normals[i], indices_texture_coords[i]}))
-                        cur_indices.push_back(check_map[{indices[i], indices_normals[i], indices_texture_coords[i]}]);
-                    else {
-                        glm::vec2 texcoords = {0.0, 0.0};
-                        if (indices_texture_coords[i] != -1)
-                            texcoords = {vertices_texture_coords[indices_texture_coords[i]].position.x,
-                                         vertices_texture_coords[indices_texture_coords[i]].position.y};
-                        cur_vertices.push_back({vertices[indices[i]].position,
-                                                vertices_normals[indices_normals[i]].position,
-                                                {texcoords.x, texcoords.y}
-                                               });
-                        check_map[{indices[i], indices_normals[i], indices_texture_coords[i]}] = cur;
-                        cur_indices.push_back(cur++);
-                    }
-                }
+            if (keyword == "vt") {
+                glm::vec2 texcoord(0.f);
+                parse_floats(arguments, &texcoord.x, 2);
+                texture_coords.push_back(texcoord);
+                continue;
+            }
 
-                Object o(cur_vertices, cur_indices, cur_mtl);
-                objects.push_back(o);
-                cur_mtl = m[mtl_name];
-                indices.clear();
-                indices_normals.clear();
-                indices_texture_coords.clear();
+            if (keyword == "s") {
+                std::string_view group = obj_keyword(arguments);
+                cur_group = 0;
+                if (group != "off")
+                    std::from_chars(group.data(), group.data() + group.size(), cur_group);
                 continue;
             }
 
-            if (type == "f")
-            {
-                std::uint32_t i0, i1, i2;
-                std::vector<std::tuple<std::uint32_t, std::uint32_t, std::uint32_t>> cur_indices;
-                char c;
-                std::vector<std::uint32_t> is;
-                std::string s;
-                while(line_stream >> s) {
-                    std::stringstream ss(s);
-                    if (s.find("//") != std::string::npos) {
-                        ss >> i0 >> c >> c >> i2;
-                        i1 = 0;
-                    }
-                    else
-                        ss >> i0 >> c >> i1 >> c >> i2;
-                    cur_indices.push_back({--i0, --i1, --i2});
-                }
+            if (keyword.empty() || keyword[0] == '#' || keyword == "g" || keyword == "mtllib" || keyword == "o"
+                || keyword == "l")
+                continue;
 
-                for (int i = 1; i < cur_indices.size() - 1; i++) {
-                    indices.push_back(std::get<0>(cur_indices[0]));
-                    indices.push_back(std::get<0>(cur_indices[i]));
-                    indices.push_back(std::get<0>(cur_indices[i + 1]));
-                    indices_texture_coords.push_back(std::get<1>(cur_indices[0]));
-                    indices_texture_coords.push_back(std::get<1>(cur_indices[i]));
-                    indices_texture_coords.push_back(std::get<1>(cur_indices[i + 1]));
-                    indices_normals.push_back(std::get<2>(cur_indices[0]));
-                    indices_normals.push_back(std::get<2>(cur_indices[i]));
-                    indices_normals.push_back(std::get<2>(cur_indices[i + 1]));
+            if (keyword == "usemtl") {
+                std::string mtl_name(obj_keyword(arguments));
+                if (materials.back().first == corner_count) {
+                    materials.back().second = m[mtl_name];
+                    continue;
+                }
+                if (direct) {
+                    objects.push_back(builder.finish(materials.back().second));
+                    reserve_object(materials.size());
                 }
+                materials.emplace_back(corner_count, m[mtl_name]);
                 continue;
             }
 
-            throw std::runtime_error("Unknown OBJ row type: " + type);
+            throw std::runtime_error("Unknown OBJ row type: " + std::string(keyword));
         }
-        std::vector<vertex> cur_vertices;
-        std::vector<vertex> cur_vertices_normals;
-        std::vector<vertex> cur_vertices_texture_coords;
-        std::vector<std::uint32_t> cur_indices;
-        std::vector<std::uint32_t> cur_indices_normals;
-        std::vector<std::uint32_t> cur_indices_texture_coords;
-
-        std::uint32_t cur = 0;
-
-        for (int i = 0; i < indices.size(); i++) {
-            cur_vertices.push_back({vertices[indices[i]].position,
-                                    vertices_normals[indices_normals[i]].position,
-                                    {vertices_texture_coords[indices_texture_coords[i]].position.x,
-                                     vertices_texture_coords[indices_texture_coords[i]].position.y}});
-            cur_indices.push_back(cur++);
+
+        if (direct) {
+            objects.push_back(builder.finish(materials.back().second));
+        } else {
+            if (std::find(indices_normals.begin(), indices_normals.end(), missing_index) != indices_normals.end()) {
+                auto start = std::chrono::high_resolution_clock::now();
+                std::size_t generated = generate_normals(positions, indices, face_groups, indices_normals, missing_index,
+                                                         normals);
+                std::cout << "Generated normals: " << generated << " in "
+                          << std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count()
+                          << " ms" << std::endl;
+            }
+            // normals smooth across materials, so the objects are only made now
+            for (std::size_t i = 0; i < materials.size(); i++) {
+                std::size_t end = i + 1 < materials.size() ? materials[i + 1].first : corner_count;
+                for (std::size_t corner = materials[i].first; corner < end; corner++) {
+                    std::uint32_t v[3] = {indices[corner], indices_texture_coords[corner], indices_normals[corner]};
+                    builder.add(v, positions, texture_coords, normals);
+                }
+                objects.push_back(builder.finish(materials[i].second));
+            }
         }
 
-        Object o(cur_vertices, cur_indices, cur_mtl);
-        objects.push_back(o);
+        std::cout << "Vertices: " << positions.size() << std::endl;
+        std::cout << "Normals: " << normals.size() << std::endl;
+        std::cout << "Texture Coords: " << texture_coords.size() << std::endl;
 
-        std::cout << "Objects: " << objects.size() << std::endl;
-        std::cout << "Vertices: " << vertices.size() << std::endl;
-        std::cout << "Normals: " << vertices_normals.size() << std::endl;
-        std::cout << "Texture Coords: " << vertices_texture_coords.size() << std::endl;
+        return objects;
+    }
 
+    // obj_path, if given, is the file input reads, whose baked tangents can be used.
+    static std::vector<Object> load_obj(std::istream & input, std::map<std::string, mtl_object> &m, float scale_factor = 1500,
+                                        std::filesystem::path const &obj_path = {})
+    {
+        std::vector<Object> objects = read_obj(input, m, scale_factor);
+        build_tangents(objects, obj_path);
+        if (optimize_meshes)
+            optimize_objects(objects);
+        split_objects(objects);
+        cluster_objects(objects);
+        if (Object::pack_vertices)
+            pack_objects(objects);
+        std::cout << "Objects: " << objects.size() << std::endl;
         return objects;
     }
 
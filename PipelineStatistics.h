@@ -0,0 +1,48 @@
+#ifndef SPONZA_SCENE_PIPELINESTATISTICS_H
+#define SPONZA_SCENE_PIPELINESTATISTICS_H
+
+#include <GL/glew.h>
+
+
+// Counts fragment shader invocations with ARB_pipeline_statistics_query. Queries are double buffered, so
+// results arrive one frame late instead of stalling; every result is stored under the tag passed to begin().
+class FragmentInvocationsQuery {
+private:
+    GLuint queries[2];
+    int tags[2] = {-1, -1};
+    int current = 0;
+
+public:
+    bool supported;
+    GLuint64 results[2] = {0, 0};
+
+    FragmentInvocationsQuery() {
+        supported = GLEW_ARB_pipeline_statistics_query;
+        if (supported)
+            glGenQueries(2, queries);
+    }
+
+    void begin(int tag) {
+        if (!supported)
+            return;
+        tags[current] = tag;
+        glBeginQuery(GL_FRAGMENT_SHADER_INVOCATIONS_ARB, queries[current]);
+    }
+
+    void end() {
+        if (!supported)
+            return;
+        glEndQuery(GL_FRAGMENT_SHADER_INVOCATIONS_ARB);
+
+        current = 1 - current;
+        if (tags[current] < 0)
+            return;
+        GLint available = GL_FALSE;
+        glGetQueryObjectiv(queries[current], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (available)
+            glGetQueryObjectui64v(queries[current], GL_QUERY_RESULT, &results[tags[current]]);
+    }
+};
+
+
+#endif
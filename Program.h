@@ -1,62 +1,204 @@
 #ifndef SPONZA_SCENE_PROGRAM_H
 #define SPONZA_SCENE_PROGRAM_H
 
+#include <chrono>
+#include <map>
+#include <string>
 #include "Shaders.h"
+#include "ProgramCache.h"
 
 
-GLuint create_shader(GLenum type, const char * source)
+// Shaders and programs are built in two steps: compile_shader/link_program only submit work to the driver, and
+// check_shader/check_program query the result later, so the driver can compile while the CPU does something else.
+
+GLuint compile_shader(GLenum type, const char * source)
 {
     GLuint result = glCreateShader(type);
     glShaderSource(result, 1, &source, nullptr);
     glCompileShader(result);
+    return result;
+}
+
+void check_shader(GLuint shader)
+{
     GLint status;
-    glGetShaderiv(result, GL_COMPILE_STATUS, &status);
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
     if (status != GL_TRUE)
     {
         GLint info_log_length;
-        glGetShaderiv(result, GL_INFO_LOG_LENGTH, &info_log_length);
+        glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &info_log_length);
         std::string info_log(info_log_length, '\0');
-        glGetShaderInfoLog(result, info_log.size(), nullptr, info_log.data());
+        glGetShaderInfoLog(shader, info_log.size(), nullptr, info_log.data());
         throw std::runtime_error("Shader compilation failed: " + info_log);
     }
-    return result;
 }
 
-GLuint create_program(GLuint vertex_shader, GLuint fragment_shader)
+GLuint link_program(GLuint vertex_shader, GLuint fragment_shader)
 {
     GLuint result = glCreateProgram();
     glAttachShader(result, vertex_shader);
     glAttachShader(result, fragment_shader);
+    if (program_binaries_supported())
+        glProgramParameteri(result, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
     glLinkProgram(result);
+    return result;
+}
 
+void check_program(GLuint program)
+{
     GLint status;
-    glGetProgramiv(result, GL_LINK_STATUS, &status);
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
     if (status != GL_TRUE)
     {
         GLint info_log_length;
-        glGetProgramiv(result, GL_INFO_LOG_LENGTH, &info_log_length);
+        glGetProgramiv(program, GL_INFO_LOG_LENGTH, &info_log_length);
         std::string info_log(info_log_length, '\0');
-        glGetProgramInfoLog(result, info_log.size(), nullptr, info_log.data());
+        glGetProgramInfoLog(program, info_log.size(), nullptr, info_log.data());
         throw std::runtime_error("Program linkage failed: " + info_log);
     }
+}
+
+bool parallel_shader_compile_supported()
+{
+    return GLEW_KHR_parallel_shader_compile || GLEW_ARB_parallel_shader_compile;
+}
+
+// Lets the driver use as many compiler threads as it wants.
+void enable_parallel_shader_compile()
+{
+    if (GLEW_KHR_parallel_shader_compile)
+        glMaxShaderCompilerThreadsKHR(0xFFFFFFFFu);
+    else if (GLEW_ARB_parallel_shader_compile)
+        glMaxShaderCompilerThreadsARB(0xFFFFFFFFu);
+}
+
+class ProgramBuildTimer {
+private:
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
+public:
+    ~ProgramBuildTimer() {
+        program_cache_stats.build_ms += std::chrono::duration<float, std::milli>(
+                std::chrono::high_resolution_clock::now() - start).count();
+    }
+};
+
+// A program submitted to the driver, taken from the on-disk binary cache when possible.
+class ProgramBuild {
+private:
+    GLuint vertex_shader = 0, fragment_shader = 0;
+    std::filesystem::path cache_path;
+
+public:
+    GLuint program = 0;
 
+    void start(const char *vertex_source, const char *fragment_source) {
+        ProgramBuildTimer timer;
+        if (program_binaries_supported()) {
+            cache_path = program_cache_path(vertex_source, fragment_source);
+            program = load_program_binary(cache_path);
+        }
+
+        if (program != 0) {
+            program_cache_stats.hits++;
+            return;
+        }
+        program_cache_stats.misses++;
+        vertex_shader = compile_shader(GL_VERTEX_SHADER, vertex_source);
+        fragment_shader = compile_shader(GL_FRAGMENT_SHADER, fragment_source);
+        program = link_program(vertex_shader, fragment_shader);
+    }
+
+    // Doesn't block; without parallel_shader_compile the driver can't tell, so this is always true.
+    bool ready() const {
+        if (vertex_shader == 0 || !parallel_shader_compile_supported())
+            return true;
+        GLint completed = GL_FALSE;
+        glGetProgramiv(program, GL_COMPLETION_STATUS_KHR, &completed);
+        return completed == GL_TRUE;
+    }
+
+    // Waits for the driver and reports compilation or linkage errors.
+    GLuint finish() {
+        if (vertex_shader == 0)
+            return program;
+
+        ProgramBuildTimer timer;
+        check_shader(vertex_shader);
+        check_shader(fragment_shader);
+        check_program(program);
+        glDeleteShader(vertex_shader);
+        glDeleteShader(fragment_shader);
+        vertex_shader = fragment_shader = 0;
+
+        if (!cache_path.empty())
+            save_program_binary(program, cache_path);
+        return program;
+    }
+};
+
+enum ShaderFlags : std::uint32_t {
+    SHADER_HAS_SPECULAR_MAP = 1 << 0,
+    SHADER_HAS_DIFFUSE_MAP = 1 << 1,
+    SHADER_HAS_NORMAL_MAP = 1 << 2,
+    SHADER_IS_REFLECTIVE = 1 << 3,
+    SHADER_VIRTUAL_TEXTURE = 1 << 4,
+    // vertex shader flag: the object's vertices are packed_vertex
+    SHADER_PACKED_VERTEX = 1 << 5,
+};
+
+// Inserts a #define for every set flag, and MAX_SHADOW_CASCADES, right after the #version line.
+std::string inject_defines(const char *source, std::uint32_t flags)
+{
+    static const std::pair<ShaderFlags, const char *> names[] = {
+            {SHADER_HAS_SPECULAR_MAP, "HAS_SPECULAR_MAP"},
+            {SHADER_HAS_DIFFUSE_MAP, "HAS_DIFFUSE_MAP"},
+            {SHADER_HAS_NORMAL_MAP, "HAS_NORMAL_MAP"},
+            {SHADER_IS_REFLECTIVE, "IS_REFLECTIVE"},
+            {SHADER_VIRTUAL_TEXTURE, "VIRTUAL_TEXTURE"},
+            {SHADER_PACKED_VERTEX, "PACKED_VERTEX"},
+    };
+
+    std::string result(source);
+    std::string defines = "#define MAX_SHADOW_CASCADES " + std::to_string(max_shadow_cascades) + "\n";
+    for (auto &[flag, name]: names) {
+        if (flags & flag)
+            defines += std::string("#define ") + name + "\n";
+    }
+    result.insert(result.find('\n') + 1, defines);
     return result;
 }
 
-class Program {
+// One compiled permutation of vertex_shader_source/fragment_shader_source. The locations are valid after finish().
+class ProgramVariant {
+private:
+    ProgramBuild build;
+
 public:
-    Program() {
-        auto vertex_shader = create_shader(GL_VERTEX_SHADER, vertex_shader_source);
-        auto fragment_shader = create_shader(GL_FRAGMENT_SHADER, fragment_shader_source);
-        program = create_program(vertex_shader, fragment_shader);
+    bool finished = false;
+
+    explicit ProgramVariant(std::uint32_t flags) {
+        std::string vertex_source = inject_defines(vertex_shader_source, flags & SHADER_PACKED_VERTEX);
+        std::string fragment_source = inject_defines(fragment_shader_source, flags);
+        build.start(vertex_source.c_str(), fragment_source.c_str());
+        program = build.program;
+    }
+
+    bool ready() const {
+        return finished || build.ready();
+    }
+
+    void finish() {
+        if (finished)
+            return;
+        build.finish();
+        finished = true;
 
         model_location = glGetUniformLocation(program, "model");
         view_location = glGetUniformLocation(program, "view");
         projection_location = glGetUniformLocation(program, "projection");
-        has_diffuse_map_location = glGetUniformLocation(program, "has_diffuse_map");
-        has_specular_map_location = glGetUniformLocation(program, "has_specular_map");
-        has_normal_map_location = glGetUniformLocation(program, "has_normal_map");
-        is_reflective_location = glGetUniformLocation(program, "is_reflective");
+        position_offset_location = glGetUniformLocation(program, "position_offset");
+        position_scale_location = glGetUniformLocation(program, "position_scale");
         texture_location = glGetUniformLocation(program, "tex");
         diffuse_map_location = glGetUniformLocation(program, "diffuse_map");
         specular_map_location = glGetUniformLocation(program, "specular_map");
@@ -71,7 +213,8 @@ public:
         light_direction_location = glGetUniformLocation(program, "light_direction");
         light_color_location = glGetUniformLocation(program, "light_color");
         shadow_map_program_location = glGetUniformLocation(program, "shadow_map");
-        shadow_transform_program_location = glGetUniformLocation(program, "shadow_transform");
+        shadow_transform_program_location = glGetUniformLocation(program, "shadow_transform[0]");
+        shadow_cascade_count_location = glGetUniformLocation(program, "shadow_cascade_count");
 
         point_light_position_location0 = glGetUniformLocation(program, "point_light_position[0]");
         point_light_color_location0 = glGetUniformLocation(program, "point_light_color[0]");
@@ -83,6 +226,15 @@ public:
         point_light_color_location2 = glGetUniformLocation(program, "point_light_color[2]");
         point_light_attenuation_location2 = glGetUniformLocation(program, "point_light_attenuation[2]");
 
+        vt_page_table_location = glGetUniformLocation(program, "vt_page_table");
+        vt_atlas_location = glGetUniformLocation(program, "vt_atlas");
+        vt_texture_location = glGetUniformLocation(program, "vt_texture");
+        vt_size_location = glGetUniformLocation(program, "vt_size");
+        vt_levels_location = glGetUniformLocation(program, "vt_levels");
+        vt_atlas_size_location = glGetUniformLocation(program, "vt_atlas_size");
+
+        setup_textures();
+        setup_lights();
     }
 
     void setup_textures() {
@@ -93,6 +245,8 @@ public:
         glUniform1i(specular_map_location, 3);
         glUniform1i(normal_map_location, 4);
         glUniform1i(cubemap_location, 5);
+        glUniform1i(vt_page_table_location, 6);
+        glUniform1i(vt_atlas_location, 7);
     }
 
     void setup_lights() {
@@ -114,30 +268,147 @@ public:
         glUniform3f(light_color_location, 0.8f, 0.8f, 0.8f);
     }
 
-    GLint model_location, view_location, projection_location, has_diffuse_map_location, has_specular_map_location,
-            has_normal_map_location, is_reflective_location, texture_location, diffuse_map_location,
+    GLint model_location, view_location, projection_location, position_offset_location, position_scale_location,
+            texture_location, diffuse_map_location,
             specular_map_location, normal_map_location, cubemap_location, ambient_color_location, diffuse_color_location,
             albedo_location, camera_location, light_direction_location, light_color_location, shadow_map_program_location,
-            shadow_transform_program_location, point_light_position_location0, point_light_color_location0,
+            shadow_transform_program_location, shadow_cascade_count_location, point_light_position_location0, point_light_color_location0,
             point_light_attenuation_location0, point_light_position_location1, point_light_color_location1,
-            point_light_attenuation_location1, point_light_position_location2, point_light_color_location2, point_light_attenuation_location2;
+            point_light_attenuation_location1, point_light_position_location2, point_light_color_location2, point_light_attenuation_location2,
+            vt_page_table_location, vt_atlas_location, vt_texture_location, vt_size_location, vt_levels_location,
+            vt_atlas_size_location;
     GLuint program;
 };
 
+// Fragment shader permutations selected by ShaderFlags instead of uniform branches. request() submits a variant
+// to the driver without waiting; variant() and for_each_variant() wait for the variants they hand out.
+class Program {
+private:
+    std::map<std::uint32_t, ProgramVariant> variants;
+
+public:
+    Program() = default;
+    Program(Program const &) = delete;
+    Program &operator=(Program const &) = delete;
+
+    void request(std::uint32_t flags) {
+        if (!variants.contains(flags))
+            variants.emplace(flags, ProgramVariant(flags));
+    }
+
+    ProgramVariant &variant(std::uint32_t flags) {
+        request(flags);
+        ProgramVariant &v = variants.at(flags);
+        v.finish();
+        return v;
+    }
+
+    // Finishes the variants the driver has already completed, without blocking on the others.
+    void finish_ready() {
+        for (auto &[flags, v]: variants) {
+            if (v.ready())
+                v.finish();
+        }
+    }
+
+    void finish() {
+        for (auto &[flags, v]: variants)
+            v.finish();
+    }
+
+    template <typename F>
+    void for_each_variant(F f) {
+        for (auto &[flags, v]: variants) {
+            v.finish();
+            glUseProgram(v.program);
+            f(v);
+        }
+    }
+
+    std::size_t variant_count() const {
+        return variants.size();
+    }
+};
+
 class ShadowProgram {
+private:
+    ProgramBuild build;
+
 public:
     GLuint program;
-    GLint transform_location, model_location;
+    GLint transform_location, model_location, position_offset_location, position_scale_location;
 
     ShadowProgram() {
-        auto new_vertex_shader = create_shader(GL_VERTEX_SHADER, new_vertex_shader_source);
-        auto new_fragment_shader = create_shader(GL_FRAGMENT_SHADER, new_fragment_shader_source);
-        program = create_program(new_vertex_shader, new_fragment_shader);
+        build.start(new_vertex_shader_source, new_fragment_shader_source);
+        program = build.program;
+    }
+
+    void finish() {
+        build.finish();
 
         transform_location = glGetUniformLocation(program, "shadow_transform");
         model_location = glGetUniformLocation(program, "model");
+        position_offset_location = glGetUniformLocation(program, "position_offset");
+        position_scale_location = glGetUniformLocation(program, "position_scale");
+    }
+};
+
+class DepthProgram {
+private:
+    ProgramBuild build;
+
+public:
+    GLuint program;
+    GLint model_location, view_location, projection_location, position_offset_location, position_scale_location;
+
+    // flags may hold SHADER_PACKED_VERTEX, which must match the color pass
+    explicit DepthProgram(std::uint32_t flags = 0) {
+        std::string vertex_source = inject_defines(depth_vertex_shader_source, flags);
+        build.start(vertex_source.c_str(), new_fragment_shader_source);
+        program = build.program;
+    }
+
+    void finish() {
+        build.finish();
+
+        model_location = glGetUniformLocation(program, "model");
+        view_location = glGetUniformLocation(program, "view");
+        projection_location = glGetUniformLocation(program, "projection");
+        position_offset_location = glGetUniformLocation(program, "position_offset");
+        position_scale_location = glGetUniformLocation(program, "position_scale");
     }
 };
 
 
+// Writes the virtual texture tiles every pixel needs, see VirtualTextureSystem.
+class FeedbackProgram {
+private:
+    ProgramBuild build;
+
+public:
+    GLuint program;
+    GLint model_location, view_location, projection_location, position_offset_location, position_scale_location,
+            vt_texture_location, vt_size_location, vt_levels_location, vt_lod_bias_location;
+
+    explicit FeedbackProgram(std::uint32_t flags = 0) {
+        std::string vertex_source = inject_defines(vertex_shader_source, flags);
+        build.start(vertex_source.c_str(), feedback_fragment_shader_source);
+        program = build.program;
+    }
+
+    void finish() {
+        build.finish();
+
+        model_location = glGetUniformLocation(program, "model");
+        view_location = glGetUniformLocation(program, "view");
+        projection_location = glGetUniformLocation(program, "projection");
+        position_offset_location = glGetUniformLocation(program, "position_offset");
+        position_scale_location = glGetUniformLocation(program, "position_scale");
+        vt_texture_location = glGetUniformLocation(program, "vt_texture");
+        vt_size_location = glGetUniformLocation(program, "vt_size");
+        vt_levels_location = glGetUniformLocation(program, "vt_levels");
+        vt_lod_bias_location = glGetUniformLocation(program, "vt_lod_bias");
+    }
+};
+
 #endif
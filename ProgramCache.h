@@ -0,0 +1,103 @@
+#ifndef SPONZA_SCENE_PROGRAMCACHE_H
+#define SPONZA_SCENE_PROGRAMCACHE_H
+
+#include <GL/glew.h>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "AssetCache.h"
+
+// Linked program binaries are cached on disk with glGetProgramBinary. The file name is a hash of the shader
+// sources and the driver vendor/renderer/version, so a driver update or a shader edit simply misses the cache;
+// a binary the driver rejects anyway is rebuilt from source and overwritten.
+
+struct ProgramCacheStats {
+    int hits = 0, misses = 0;
+    float build_ms = 0.f;
+};
+
+inline ProgramCacheStats program_cache_stats;
+
+const std::uint32_t program_cache_magic = 0x50424331; // "PBC1"
+
+bool program_binaries_supported()
+{
+    static bool supported = [] {
+        if (!GLEW_VERSION_4_1 && !GLEW_ARB_get_program_binary)
+            return false;
+        GLint formats = 0;
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+        return formats > 0;
+    }();
+    return supported;
+}
+
+std::filesystem::path program_cache_path(std::string_view vertex_source, std::string_view fragment_source)
+{
+    std::uint64_t hash = fnv1a(vertex_source);
+    hash = fnv1a(fragment_source, hash);
+    for (GLenum name: {GL_VENDOR, GL_RENDERER, GL_VERSION})
+        hash = fnv1a(reinterpret_cast<const char *>(glGetString(name)), hash);
+
+    std::ostringstream file_name;
+    file_name << std::hex << std::setw(16) << std::setfill('0') << hash << ".bin";
+    return std::filesystem::path(PRACTICE_SOURCE_DIRECTORY "/.cache/shaders") / file_name.str();
+}
+
+// Returns 0 if there is no usable binary for path.
+GLuint load_program_binary(std::filesystem::path const &path)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+        return 0;
+
+    std::uint32_t magic = 0;
+    GLenum format = 0;
+    file.read(reinterpret_cast<char *>(&magic), sizeof(magic));
+    file.read(reinterpret_cast<char *>(&format), sizeof(format));
+    std::error_code error;
+    std::uintmax_t size = std::filesystem::file_size(path, error);
+    const std::uintmax_t header_size = sizeof(magic) + sizeof(format);
+    if (!file || error || magic != program_cache_magic || size <= header_size)
+        return 0;
+    std::vector<char> binary(size - header_size);
+    if (!file.read(binary.data(), binary.size()))
+        return 0;
+
+    GLuint program = glCreateProgram();
+    glProgramBinary(program, format, binary.data(), binary.size());
+    GLint status;
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    if (status != GL_TRUE) {
+        glDeleteProgram(program);
+        return 0;
+    }
+    return program;
+}
+
+void save_program_binary(GLuint program, std::filesystem::path const &path)
+{
+    GLint length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0)
+        return;
+
+    std::vector<char> binary(length);
+    GLenum format;
+    glGetProgramBinary(program, length, nullptr, &format, binary.data());
+
+    std::error_code error;
+    std::filesystem::create_directories(path.parent_path(), error);
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    file.write(reinterpret_cast<const char *>(&program_cache_magic), sizeof(program_cache_magic));
+    file.write(reinterpret_cast<const char *>(&format), sizeof(format));
+    file.write(binary.data(), binary.size());
+}
+
+
+#endif
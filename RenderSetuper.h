@@ -4,30 +4,36 @@
 
 class RenderSetuper {
 private:
-    Program program;
-    ShadowProgram shadow_program;
-    int shadow_map_res, cubemap_res, width, height;
+    ShadowProgram &shadow_program;
+    int shadow_cascade_count, shadow_map_res, width, height;
     GLuint shadow_texture, cubemap_framebuffer, frame_buffer;
 
 public:
     GLuint cubemap_texture;
+    int cubemap_res;
 
-    RenderSetuper(Program program, ShadowProgram shadow_program) {
-        this->program = program;
-        this->shadow_program = shadow_program;
-        shadow_map_res = 4096;
+    RenderSetuper(ShadowProgram &shadow_program, int shadow_cascade_count, int shadow_map_res):
+            shadow_program(shadow_program) {
+        this->shadow_cascade_count = shadow_cascade_count;
+        this->shadow_map_res = shadow_map_res;
+
+        // one layer per cascade
         glGenTextures(1, &shadow_texture);
         glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, shadow_texture);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, shadow_map_res, shadow_map_res, 0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, shadow_texture);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_DEPTH_COMPONENT24, shadow_map_res, shadow_map_res, shadow_cascade_count,
+                     0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
+
+        std::cout << "Shadow cascades: " << shadow_cascade_count << " x " << shadow_map_res << "x" << shadow_map_res
+                  << " (" << shadow_cascade_count * std::size_t(shadow_map_res) * shadow_map_res * 4 / (1 << 20) << " MB)" << std::endl;
 
         glGenFramebuffers(1, &frame_buffer);
         glBindFramebuffer(GL_DRAW_FRAMEBUFFER, frame_buffer);
-        glFramebufferTexture(GL_DRAW_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, shadow_texture, 0);
+        glFramebufferTextureLayer(GL_DRAW_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, shadow_texture, 0, 0);
 
         cubemap_res = 1024;
 
@@ -55,23 +61,23 @@ public:
         glBindTexture(GL_TEXTURE_CUBE_MAP, 5);
     }
 
-    void setup_shadow_render() {
+    void setup_shadow_render(int cascade) {
         glUseProgram(shadow_program.program);
         glBindFramebuffer(GL_DRAW_FRAMEBUFFER, frame_buffer);
+        glFramebufferTextureLayer(GL_DRAW_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, shadow_texture, 0, cascade);
         glViewport(0, 0, shadow_map_res, shadow_map_res);
         glClear(GL_DEPTH_BUFFER_BIT);
         glCullFace(GL_FRONT);
     }
 
     void setup_cubemap_render() {
-        glUseProgram(program.program);
         glCullFace(GL_BACK);
 
         glViewport(0, 0, cubemap_res, cubemap_res);
 
 
         glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, shadow_texture);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, shadow_texture);
         glActiveTexture(GL_TEXTURE0 + 5);
         glBindTexture(GL_TEXTURE_CUBE_MAP, cubemap_texture);
         glBindFramebuffer(GL_DRAW_FRAMEBUFFER, cubemap_framebuffer);
@@ -84,7 +90,7 @@ public:
         glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
 
         glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, shadow_texture);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, shadow_texture);
 
         glActiveTexture(GL_TEXTURE0 + 5);
         glBindTexture(GL_TEXTURE_CUBE_MAP, cubemap_texture);
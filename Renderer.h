@@ -2,9 +2,11 @@
 #define SPONZA_SCENE_RENDERER_H
 
 #include <fstream>
+#include <algorithm>
 #include <GL/glew.h>
 #include "Program.h"
-#include "Parser.h"
+#include "ModelLoader.h"
+#include "VirtualTextureSystem.h"
 #include <glm/vec3.hpp>
 #include <glm/mat4x4.hpp>
 #include <glm/ext/matrix_transform.hpp>
@@ -18,74 +20,262 @@ struct CameraParams {
     float view_elevation, view_azimuth;
 };
 
+struct ShadowCasterStats {
+    std::size_t rendered = 0, culled = 0, triangles = 0;
+};
+
 class Renderer {
 protected:
     std::map<std::string, mtl_object> mtl;
     std::map<std::string, texture> textures;
     std::vector<Object> objects;
-    Program program;
-    ShadowProgram shadow_program;
+    Program &program;
+    ShadowProgram &shadow_program;
+    glm::mat4 model;
+
+    std::size_t uploaded_count = 0;
+    bool variants_requested = false, model_received = false;
+
+    // largest error of a level of detail on screen, in pixels or shadow map texels
+    static constexpr float lod_pixel_error = 1.f;
+
+    Renderer(Program &program, ShadowProgram &shadow_program): program(program), shadow_program(shadow_program) {}
+
+    virtual void request_variants(std::map<std::string, mtl_object> const &materials) = 0;
+    virtual void on_model_loaded() = 0;
+
+    // quantized positions of object, for programs that decode them
+    static void set_position_decode(Object &object, GLint offset_location, GLint scale_location) {
+        glUniform3fv(offset_location, 1, reinterpret_cast<float *>(&object.position_offset));
+        glUniform3fv(scale_location, 1, reinterpret_cast<float *>(&object.position_scale));
+    }
+
+    static std::uint32_t vertex_shader_flags() {
+        return Object::pack_vertices ? std::uint32_t(SHADER_PACKED_VERTEX) : 0u;
+    }
+
+    static std::uint32_t material_shader_flags(mtl_object const &material) {
+        std::uint32_t flags = vertex_shader_flags();
+        if (material.map_Ks != "")
+            flags |= SHADER_HAS_SPECULAR_MAP;
+        if (material.map_Kd != "")
+            flags |= SHADER_HAS_DIFFUSE_MAP;
+        if (material.norm != "")
+            flags |= SHADER_HAS_NORMAL_MAP;
+        return flags;
+    }
+
+    void select_variants() {
+        for (Object &object: objects)
+            object.shader_flags = material_shader_flags(object.mtl);
+    }
 
 public:
     virtual void render() = 0;
+
+    // Streams the model from the loader: program variants are requested as soon as the materials are parsed, so
+    // the driver compiles them while the OBJ is still being read, then objects are uploaded until the deadline
+    // (at least one per call). Returns true once every object is uploaded; texels may still be in the uploader.
+    bool load_step(ModelLoader &loader, TextureRegistry &registry, std::chrono::high_resolution_clock::time_point deadline) {
+        if (!variants_requested && loader.materials_ready()) {
+            request_variants(loader.get_materials());
+            variants_requested = true;
+        }
+
+        if (!model_received) {
+            if (!loader.ready())
+                return false;
+            Model model = loader.get();
+            mtl = std::move(model.mtl);
+            textures = std::move(model.textures);
+            objects = std::move(model.objects);
+            model_received = true;
+            on_model_loaded();
+        }
+
+        while (uploaded_count < objects.size()) {
+            objects[uploaded_count].upload();
+            objects[uploaded_count].upload_textures(registry);
+            uploaded_count++;
+            if (std::chrono::high_resolution_clock::now() >= deadline)
+                break;
+        }
+        return uploaded_count == objects.size();
+    }
+
+    std::size_t object_count() const {
+        return objects.size();
+    }
+
+    std::size_t uploaded_object_count() const {
+        return uploaded_count;
+    }
+
+    // Renders only the objects whose bounds intersect the light volume of shadow_transform, each at the level of
+    // detail a shadow map of resolution^2 texels needs. The shadow pass culls front faces, so do its meshlets.
+    void render_shadow(glm::mat4 const &shadow_transform, int resolution, ShadowCasterStats &stats) {
+        glUniformMatrix4fv(shadow_program.model_location, 1, GL_FALSE, reinterpret_cast<float *>(&model));
+        glm::mat4 transform = shadow_transform * model;
+        MeshletCuller culler(transform, true);
+
+        for (Object &object : objects) {
+            if (!object.uploaded)
+                continue;
+            if (!object.bounds.intersects(transform)) {
+                stats.culled++;
+                continue;
+            }
+            int lod = object.select_lod(transform, float(resolution), lod_pixel_error);
+            stats.rendered++;
+            std::size_t submitted = Object::meshlet_stats.triangles;
+            set_position_decode(object, shadow_program.position_offset_location, shadow_program.position_scale_location);
+            object.render_depth(lod, &culler);
+            stats.triangles += Object::meshlet_stats.triangles - submitted;
+        }
+    }
+
+    // Depth pre-pass over the opaque objects; the depth stream must hold float positions to match the color pass.
+    void render_depth(DepthProgram &depth_program, glm::mat4 const &view_projection) {
+        glUniformMatrix4fv(depth_program.model_location, 1, GL_FALSE, reinterpret_cast<float *>(&model));
+        MeshletCuller culler(view_projection * model, false);
+
+        for (Object &object : objects) {
+            if (object.uploaded && !object.is_transparent()) {
+                set_position_decode(object, depth_program.position_offset_location, depth_program.position_scale_location);
+                object.render_depth(0, &culler);
+            }
+        }
+    }
 };
 
 class SceneRenderer: Renderer {
 private:
-    glm::mat4 view, projection, model;
-    float near, far;
+    glm::mat4 view, projection, light_view;
+    glm::vec3 light_direction;
+    float near, far, fov, aspect;
+    bounding_box scene_bounds;
+    int shadow_cascade_count, shadow_map_res;
+    float shadow_split_lambda;
+    std::vector<glm::mat4> shadow_transforms;
+    std::size_t opaque_count;
+    // albedo is sampled through virtual textures while set
+    VirtualTextureSystem *virtual_textures = nullptr;
+    // while lod_pixels is set, objects are drawn at the level of detail a lod_pixels high view through
+    // lod_view_projection needs; otherwise at full detail
+    glm::mat4 lod_view_projection;
+    float lod_pixels = 0.f;
+
+    // objects are grouped by variant, so the program only changes between groups
+    void render_objects(std::size_t begin, std::size_t end) {
+        std::uint32_t mode_flags = virtual_textures != nullptr ? std::uint32_t(SHADER_VIRTUAL_TEXTURE) : 0u;
+        MeshletCuller culler((lod_pixels > 0.f ? lod_view_projection : projection * view) * model, false);
+        ProgramVariant *variant = nullptr;
+        for (std::size_t i = begin; i < end; i++) {
+            Object &object = objects[i];
+            // objects are uploaded in order, the rest of them isn't ready yet
+            if (!object.uploaded)
+                break;
+            if (i == begin || object.shader_flags != objects[i - 1].shader_flags) {
+                variant = &program.variant(object.shader_flags | mode_flags);
+                glUseProgram(variant->program);
+            }
+            glUniform3f(variant->ambient_color_location, object.mtl.Ka.x, object.mtl.Ka.y, object.mtl.Ka.z);
+            glUniform3f(variant->diffuse_color_location, object.mtl.Kd.x, object.mtl.Kd.y, object.mtl.Kd.z);
+            set_position_decode(object, variant->position_offset_location, variant->position_scale_location);
+            if (virtual_textures != nullptr)
+                virtual_textures->bind(*variant, object.virtual_texture);
+
+            int lod = lod_pixels > 0.f ? object.select_lod(lod_view_projection * model, lod_pixels, lod_pixel_error) : 0;
+            object.render(lod, &culler);
+        }
+    }
 public:
-    SceneRenderer(Program program, ShadowProgram shadow_program, std::string mtl_path, std::string obj_path) {
-        this->program = program;
-        this->shadow_program = shadow_program;
-        std::ifstream mtl_file(PRACTICE_SOURCE_DIRECTORY + mtl_path);
-        std::tie(mtl, textures) = Parser::load_mtl(mtl_file);
-        std::ifstream obj_file(PRACTICE_SOURCE_DIRECTORY + obj_path);
-        objects = Parser::load_obj(obj_file, mtl);
+    using Renderer::render_shadow;
+    using Renderer::render_depth;
+    using Renderer::load_step;
+    using Renderer::object_count;
+    using Renderer::uploaded_object_count;
 
+    SceneRenderer(Program &program, ShadowProgram &shadow_program): Renderer(program, shadow_program) {
+        model = glm::mat4(1.f);
+
+        near = 0.01f;
+        far = 10.f;
+        fov = glm::pi<float>() / 2.f;
+    }
+
+    void request_variants(std::map<std::string, mtl_object> const &materials) override {
+        for (auto &[name, material]: materials)
+            program.request(material_shader_flags(material));
+    }
+
+    void on_model_loaded() override {
         for (Object &object: objects)
-            object.load_textures(textures);
-
-        std::vector<Object> objects1, objects2;
-        for (Object &obj: objects) {
-            if (obj.map_Ka == nullptr || obj.map_Ka->channels != 4)
-                objects1.push_back(obj);
-            else
-                objects2.push_back(obj);
-        }
-        objects.clear();
+            object.bind_textures(textures);
 
-        for (Object &obj: objects1)
-            objects.push_back(obj);
+        select_variants();
 
-        for (Object &obj: objects2)
-            objects.push_back(obj);
+        // transparent objects go last, each half is grouped by program variant
+        std::stable_sort(objects.begin(), objects.end(), [](Object const &a, Object const &b) {
+            return std::make_pair(a.is_transparent(), a.shader_flags) < std::make_pair(b.is_transparent(), b.shader_flags);
+        });
+        opaque_count = std::count_if(objects.begin(), objects.end(), [](Object const &o) { return !o.is_transparent(); });
 
-        model = glm::mat4(1.f);
+        for (Object &obj: objects)
+            scene_bounds.extend(obj.bounds);
 
-        near = 0.01f;
-        far = 10.f;
+        program.finish_ready();
     }
 
     void render() override {
-        glUniformMatrix4fv(shadow_program.model_location, 1, GL_FALSE, reinterpret_cast<float *>(&model));
-
-        for (Object &object : objects) {
-            glUniform3f(program.ambient_color_location, object.mtl.Ka.x, object.mtl.Ka.y, object.mtl.Ka.z);
-            glUniform3f(program.diffuse_color_location, object.mtl.Kd.x, object.mtl.Kd.y, object.mtl.Kd.z);
+        render_objects(0, objects.size());
+    }
 
-            glUniform1i(program.has_diffuse_map_location, object.has_diffuse_map);
-            glUniform1i(program.has_specular_map_location, object.has_specular_map);
-            glUniform1i(program.has_normal_map_location, object.has_normal_map);
-            glUniform1i(program.is_reflective_location, false);
+    // Switches albedo sampling to virtual textures, or back with nullptr; call once everything is loaded.
+    void set_virtual_textures(VirtualTextureSystem *system) {
+        virtual_textures = system;
+        if (system == nullptr)
+            return;
+        for (Object &object: objects) {
+            if (object.has_texture)
+                object.virtual_texture = system->add(*object.map_Ka);
+            program.request(object.shader_flags | SHADER_VIRTUAL_TEXTURE);
+        }
+    }
 
-            object.render();
+    // Renders the tiles each pixel needs into the target bound by VirtualTextureSystem::begin_feedback().
+    void render_feedback(FeedbackProgram &feedback_program) {
+        glUseProgram(feedback_program.program);
+        glUniformMatrix4fv(feedback_program.model_location, 1, GL_FALSE, reinterpret_cast<float *>(&model));
+        glUniformMatrix4fv(feedback_program.view_location, 1, GL_FALSE, reinterpret_cast<float *>(&view));
+        glUniformMatrix4fv(feedback_program.projection_location, 1, GL_FALSE, reinterpret_cast<float *>(&projection));
+        glUniform1f(feedback_program.vt_lod_bias_location, VirtualTextureSystem::feedback_lod_bias());
+        MeshletCuller culler(projection * view * model, false);
+
+        for (Object &object: objects) {
+            if (!object.uploaded)
+                continue;
+            virtual_textures->bind_feedback(feedback_program, object.virtual_texture);
+            set_position_decode(object, feedback_program.position_offset_location, feedback_program.position_scale_location);
+            object.render(0, &culler);
         }
     }
 
-    void render_cubemap(glm::vec3 translation, GLuint cubemap_texture) {
-        glm::mat4 cubemap_perspective = glm::perspective(glm::pi<float>() / 2.f, 1.f, near, far);
-        glUniformMatrix4fv(program.projection_location, 1, GL_FALSE, reinterpret_cast<float *>(&cubemap_perspective));
+    void render_opaque() {
+        render_objects(0, opaque_count);
+    }
+
+    void render_transparent() {
+        render_objects(opaque_count, objects.size());
+    }
+
+    // The six faces are resolution^2 pixels and use coarser levels of detail than the camera view.
+    void render_cubemap(glm::vec3 translation, GLuint cubemap_texture, int resolution) {
+        glm::mat4 cubemap_perspective = glm::perspective(fov, 1.f, near, far);
+        program.for_each_variant([&](ProgramVariant &v) {
+            glUniformMatrix4fv(v.model_location, 1, GL_FALSE, reinterpret_cast<float *>(&model));
+            glUniformMatrix4fv(v.projection_location, 1, GL_FALSE, reinterpret_cast<float *>(&cubemap_perspective));
+        });
 
         glm::mat4 shrek_view(1.f);
         std::vector<glm::mat4> shrek_views = {
@@ -100,11 +290,16 @@ public:
         for (int i = 0; i < 6; i++) {
             glFramebufferTexture2D(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, cubemap_texture, 0);
 
-            glUniformMatrix4fv(program.view_location, 1, GL_FALSE, reinterpret_cast<float *>(&shrek_views[i]));
+            program.for_each_variant([&](ProgramVariant &v) {
+                glUniformMatrix4fv(v.view_location, 1, GL_FALSE, reinterpret_cast<float *>(&shrek_views[i]));
+            });
             glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
+            lod_view_projection = cubemap_perspective * shrek_views[i];
+            lod_pixels = float(resolution);
             render();
         }
+        lod_pixels = 0.f;
     }
 
     glm::mat4 get_view(float x, float y, float z, glm::vec3 translation) {
@@ -117,9 +312,21 @@ public:
     }
 
     void reset_params() {
-        glUniformMatrix4fv(program.model_location, 1, GL_FALSE, reinterpret_cast<float *>(&model));
-        glUniformMatrix4fv(program.view_location, 1, GL_FALSE, reinterpret_cast<float *>(&view));
-        glUniformMatrix4fv(program.projection_location, 1, GL_FALSE, reinterpret_cast<float *>(&projection));
+        program.for_each_variant([&](ProgramVariant &v) {
+            glUniformMatrix4fv(v.model_location, 1, GL_FALSE, reinterpret_cast<float *>(&model));
+            glUniformMatrix4fv(v.view_location, 1, GL_FALSE, reinterpret_cast<float *>(&view));
+            glUniformMatrix4fv(v.projection_location, 1, GL_FALSE, reinterpret_cast<float *>(&projection));
+        });
+    }
+
+    glm::mat4 get_view_projection() const {
+        return projection * view;
+    }
+
+    void setup_depth_prepass(DepthProgram &depth_program) {
+        glUseProgram(depth_program.program);
+        glUniformMatrix4fv(depth_program.view_location, 1, GL_FALSE, reinterpret_cast<float *>(&view));
+        glUniformMatrix4fv(depth_program.projection_location, 1, GL_FALSE, reinterpret_cast<float *>(&projection));
     }
 
     void update_view(CameraParams params) {
@@ -129,65 +336,138 @@ public:
         view = glm::rotate(view, params.view_azimuth, {0.f, 1.f, 0.f});
 
         glm::vec3 camera_position = (glm::inverse(view) * glm::vec4(0.0, 0.0, 0.0, 1.0));
-        glUniform3f(program.camera_location, camera_position.x, camera_position.y, camera_position.z);
+        program.for_each_variant([&](ProgramVariant &v) {
+            glUniform3f(v.camera_location, camera_position.x, camera_position.y, camera_position.z);
+        });
     }
 
     void update_projection(float width, float height) {
-        projection = glm::perspective(glm::pi<float>() / 2.f, (1.f * width) / height, near, far);
-    }
-
-    void setup_shadows_settings() {
-        glm::vec3 light_direction = glm::vec3(0.05f, .7f, 0.05f);
-
-        auto light_Z = -light_direction;
-        auto light_X = glm::vec3(light_Z.y, -light_Z.x, 0.0);
-        auto light_Y = glm::cross(light_X, light_Z);
-
-        auto shadow_transform = glm::mat4(0.f);
-        shadow_transform[0][0] = light_X[0];
-        shadow_transform[1][0] = light_X[1];
-        shadow_transform[2][0] = light_X[2];
-        shadow_transform[0][1] = light_Y[0];
-        shadow_transform[1][1] = light_Y[1];
-        shadow_transform[2][1] = light_Y[2];
-        shadow_transform[0][2] = light_Z[0];
-        shadow_transform[1][2] = light_Z[1];
-        shadow_transform[2][2] = light_Z[2];
-        shadow_transform[3][3] = 1.f;
-
-        glUseProgram(program.program);
-        glUniformMatrix4fv(program.shadow_transform_program_location, 1, GL_FALSE, reinterpret_cast<float *>(&shadow_transform));
-        glUniform3fv(program.light_direction_location, 1, reinterpret_cast<float *>(&light_direction));
-        glUseProgram(shadow_program.program);
-        glUniformMatrix4fv(shadow_program.transform_location, 1, GL_FALSE, reinterpret_cast<float *>(&shadow_transform));
+        aspect = (1.f * width) / height;
+        projection = glm::perspective(fov, aspect, near, far);
+    }
+
+    void setup_shadows_settings(int cascade_count, int map_res) {
+        light_direction = glm::vec3(0.05f, .7f, 0.05f);
+
+        if (cascade_count < 1 || cascade_count > max_shadow_cascades)
+            throw std::runtime_error("Shadow cascade count " + std::to_string(cascade_count) + " is not between 1 and "
+                                     + std::to_string(max_shadow_cascades));
+        shadow_cascade_count = cascade_count;
+        shadow_map_res = map_res;
+        shadow_split_lambda = 0.75f;
+        shadow_transforms.assign(shadow_cascade_count, glm::mat4(1.f));
+        light_view = glm::lookAt(glm::vec3(0.f), -glm::normalize(light_direction), {0.f, 0.f, 1.f});
+    }
+
+    // Fits every cascade to its slice of the camera frustum; call after update_view and update_projection.
+    void update_shadow_cascades() {
+        if (objects.empty())
+            return;
+
+        glm::mat4 inverse_view = glm::inverse(view);
+
+        // scene extent along the light direction, so that casters outside the camera frustum are kept
+        float scene_min_z = std::numeric_limits<float>::max(), scene_max_z = std::numeric_limits<float>::lowest();
+        for (int i = 0; i < 8; i++) {
+            float z = (light_view * glm::vec4(scene_bounds.corner(i), 1.f)).z;
+            scene_min_z = std::min(scene_min_z, z);
+            scene_max_z = std::max(scene_max_z, z);
+        }
+
+        float shadow_distance = std::min(far, glm::length(scene_bounds.max - scene_bounds.min));
+        float tan_half_fov = std::tan(fov / 2.f);
+        float split_near = near;
+
+        for (int i = 0; i < shadow_cascade_count; i++) {
+            // practical split scheme: blend of logarithmic and uniform splits
+            float t = (i + 1.f) / shadow_cascade_count;
+            float split_far = shadow_split_lambda * near * std::pow(shadow_distance / near, t) +
+                              (1.f - shadow_split_lambda) * (near + (shadow_distance - near) * t);
+
+            glm::vec3 corners[8];
+            glm::vec3 center(0.f);
+            for (int j = 0; j < 8; j++) {
+                float z = (j & 4) ? split_far : split_near;
+                glm::vec4 corner = {((j & 1) ? 1.f : -1.f) * tan_half_fov * aspect * z,
+                                    ((j & 2) ? 1.f : -1.f) * tan_half_fov * z, -z, 1.f};
+                corners[j] = light_view * inverse_view * corner;
+                center += corners[j] / 8.f;
+            }
+
+            // a bounding sphere keeps the cascade size independent of the camera rotation
+            float radius = 0.f;
+            for (auto &corner: corners)
+                radius = std::max(radius, glm::length(corner - center));
+            radius = std::ceil(radius * 16.f) / 16.f;
+
+            // snap to whole texels so that the shadow edges don't shimmer while the camera moves
+            float texel = 2.f * radius / shadow_map_res;
+            center.x = std::floor(center.x / texel) * texel;
+            center.y = std::floor(center.y / texel) * texel;
+
+            glm::mat4 light_projection = glm::ortho(center.x - radius, center.x + radius,
+                                                    center.y - radius, center.y + radius,
+                                                    -scene_max_z, -std::max(scene_min_z, center.z - radius));
+            shadow_transforms[i] = light_projection * light_view;
+            split_near = split_far;
+        }
+
+        // also resent every frame so that variants compiled while streaming get them
+        program.for_each_variant([&](ProgramVariant &v) {
+            glUniform3fv(v.light_direction_location, 1, reinterpret_cast<float *>(&light_direction));
+            glUniform1i(v.shadow_cascade_count_location, shadow_cascade_count);
+            glUniformMatrix4fv(v.shadow_transform_program_location, shadow_cascade_count, GL_FALSE,
+                               reinterpret_cast<float *>(shadow_transforms.data()));
+        });
+    }
+
+    void setup_shadow_cascade(int cascade) {
+        glUniformMatrix4fv(shadow_program.transform_location, 1, GL_FALSE, reinterpret_cast<float *>(&shadow_transforms[cascade]));
+    }
+
+    glm::mat4 const &get_shadow_transform(int cascade) const {
+        return shadow_transforms[cascade];
     }
 };
 
 class ShrekRenderer: Renderer {
-private:
-    glm::mat4 model;
 public:
+    using Renderer::render_shadow;
+    using Renderer::render_depth;
+    using Renderer::load_step;
+    using Renderer::object_count;
+    using Renderer::uploaded_object_count;
+
     glm::vec3 translate;
 
-    ShrekRenderer(Program program, ShadowProgram shadow_program, std::string mtl_path, std::string obj_path) {
-        this->program = program;
-        this->shadow_program = shadow_program;
-        std::ifstream mtl_file(PRACTICE_SOURCE_DIRECTORY + mtl_path);
-        std::tie(mtl, textures) = Parser::load_mtl(mtl_file);
-        std::ifstream obj_file(PRACTICE_SOURCE_DIRECTORY + obj_path);
-        objects = Parser::load_obj(obj_file, mtl, 100);
+    ShrekRenderer(Program &program, ShadowProgram &shadow_program): Renderer(program, shadow_program) {}
+
+    // every material gets the reflective variant
+    void request_variants(std::map<std::string, mtl_object> const &) override {
+        program.request(SHADER_IS_REFLECTIVE | vertex_shader_flags());
+    }
+
+    void on_model_loaded() override {
+        // the reflection replaces all material lighting
+        for (Object &object: objects)
+            object.shader_flags = SHADER_IS_REFLECTIVE | vertex_shader_flags();
     }
 
     void render() override {
-        glUniformMatrix4fv(shadow_program.model_location, 1, GL_FALSE, reinterpret_cast<float *>(&model));
         for (Object &object : objects) {
-            glUniform1i(program.is_reflective_location, true);
+            if (!object.uploaded)
+                continue;
+            ProgramVariant &variant = program.variant(object.shader_flags);
+            glUseProgram(variant.program);
+            set_position_decode(object, variant.position_offset_location, variant.position_scale_location);
             object.render();
         }
     }
 
     void reset_params() {
-        glUniformMatrix4fv(program.model_location, 1, GL_FALSE, reinterpret_cast<float *>(&model));
+        program.for_each_variant([&](ProgramVariant &v) {
+            glUniformMatrix4fv(v.model_location, 1, GL_FALSE, reinterpret_cast<float *>(&model));
+        });
     }
 
     void change_time(float time) {
@@ -1,6 +1,9 @@
 #ifndef SPONZA_SCENE_SHADERS_H
 #define SPONZA_SCENE_SHADERS_H
 
+// Size of the shadow_transform array in fragment_shader_source, which inject_defines passes as MAX_SHADOW_CASCADES.
+const int max_shadow_cascades = 8;
+
 const char vertex_shader_source[] =
         R"(#version 330 core
 
@@ -9,21 +12,67 @@ uniform mat4 view;
 uniform mat4 projection;
 
 layout (location = 0) in vec3 in_position;
+#ifdef PACKED_VERTEX
+// packed_vertex: positions relative to the object bounds, octahedral normals
+uniform vec3 position_offset;
+uniform vec3 position_scale;
+
+layout (location = 1) in vec2 in_normal;
+// angle in the upper 15 bits, bitangent sign in bit 0
+layout (location = 3) in float in_tangent;
+
+vec3 octahedral_decode(vec2 e)
+{
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    float t = max(-n.z, 0.0);
+    n.xy += vec2(n.x >= 0.0 ? -t : t, n.y >= 0.0 ? -t : t);
+    return normalize(n);
+}
+
+// same as decode_tangent in VertexFormat.h; the hemisphere comes from the quantized normal, not from n.z
+vec4 tangent_decode(float bits_value, vec2 e, vec3 n)
+{
+    vec2 k = round(e * 32767.0);
+    float s = abs(k.x) + abs(k.y) <= 32767.0 ? 1.0 : -1.0;
+    float a = -1.0 / (s + n.z);
+    float b = n.x * n.y * a;
+    vec3 b1 = vec3(1.0 + s * n.x * n.x * a, s * b, -s * n.x);
+    vec3 b2 = vec3(b, s + n.y * n.y * a, -n.y);
+    uint bits = uint(bits_value);
+    float angle = float(bits >> 1u) * (6.28318530718 / 32768.0);
+    return vec4(cos(angle) * b1 + sin(angle) * b2, (bits & 1u) != 0u ? -1.0 : 1.0);
+}
+#else
 layout (location = 1) in vec3 in_normal;
+layout (location = 3) in vec4 in_tangent;
+#endif
 layout (location = 2) in vec2 in_texcoord;
 
 out vec3 position;
 out vec3 raw_pos;
 out vec3 normal;
+out vec4 tangent;
 out vec2 texcoord;
 
+invariant gl_Position;
+
 void main()
 {
-	gl_Position = projection * view * model * vec4(in_position, 1.0);
-	position = (model * vec4(in_position, 1.0)).xyz;
-	normal = normalize((model * vec4(in_normal, 0.0)).xyz);
+#ifdef PACKED_VERTEX
+    vec3 object_position = position_offset + in_position * position_scale;
+    vec3 object_normal = octahedral_decode(in_normal);
+    vec4 object_tangent = tangent_decode(in_tangent, in_normal, object_normal);
+#else
+    vec3 object_position = in_position;
+    vec3 object_normal = in_normal;
+    vec4 object_tangent = in_tangent;
+#endif
+	gl_Position = projection * view * model * vec4(object_position, 1.0);
+	position = (model * vec4(object_position, 1.0)).xyz;
+	normal = normalize((model * vec4(object_normal, 0.0)).xyz);
+	tangent = vec4((model * vec4(object_tangent.xyz, 0.0)).xyz, object_tangent.w);
     texcoord = vec2(in_texcoord.x, -in_texcoord.y);
-    raw_pos = in_position;
+    raw_pos = object_position;
 }
 )";
 
@@ -38,11 +87,6 @@ uniform vec3 point_light_position[3];
 uniform vec3 point_light_color[3];
 uniform vec3 point_light_attenuation[3];
 
-uniform bool has_specular_map;
-uniform bool has_diffuse_map;
-uniform bool has_normal_map;
-uniform bool is_reflective;
-
 uniform sampler2D tex;
 uniform sampler2D specular_map;
 uniform sampler2D diffuse_map;
@@ -51,18 +95,60 @@ uniform samplerCube cubemap;
 
 uniform vec3 light_direction;
 uniform vec3 light_color;
-uniform mat4 shadow_transform;
+uniform mat4 shadow_transform[MAX_SHADOW_CASCADES];
+uniform int shadow_cascade_count;
 uniform mat4 model;
 uniform mat4 view;
-uniform sampler2D shadow_map;
+uniform sampler2DArray shadow_map;
 
 in vec3 position;
 in vec3 raw_pos;
 in vec3 normal;
+in vec4 tangent;
 in vec2 texcoord;
 
 layout (location = 0) out vec4 out_color;
 
+#ifdef VIRTUAL_TEXTURE
+// per tile and level: atlas slot x, slot y and level of the nearest resident tile, alpha 0 if there is none
+uniform sampler2D vt_page_table;
+uniform sampler2D vt_atlas;
+// 0 if tex is not a virtual texture
+uniform int vt_texture;
+uniform vec2 vt_size;
+uniform int vt_levels;
+uniform float vt_atlas_size;
+
+// tex is the fallback for levels without tiles and for tiles that aren't streamed in yet
+vec4 sample_albedo()
+{
+    vec4 fallback = texture(tex, texcoord);
+    if (vt_texture == 0)
+        return fallback;
+
+    // must pick the same level and tile as feedback_fragment_shader_source
+    vec2 texel = texcoord * vt_size;
+    vec2 dx = dFdx(texel), dy = dFdy(texel);
+    int level = int(floor(max(0.0, 0.5 * log2(max(dot(dx, dx), dot(dy, dy))))));
+    if (level >= vt_levels)
+        return fallback;
+
+    vec2 uv = fract(texcoord);
+    ivec2 tile = ivec2(uv * vt_size / (128.0 * exp2(float(level))));
+    vec4 entry = texelFetch(vt_page_table, tile, level) * 255.0;
+    if (entry.a == 0.0)
+        return fallback;
+
+    vec2 in_tile = fract(uv * vt_size / (128.0 * exp2(entry.b)));
+    return textureLod(vt_atlas, (entry.xy * 136.0 + 4.0 + in_tile * 128.0) / vt_atlas_size, 0.0);
+}
+#else
+vec4 sample_albedo()
+{
+    return texture(tex, texcoord);
+}
+#endif
+
 vec3 get_color(int idx, vec3 normal_) {
 
     vec3 light_vector = point_light_position[idx] - position;
@@ -72,9 +158,9 @@ vec3 get_color(int idx, vec3 normal_) {
 
     vec3 reflected =  2.0 * normal_ * dot(normal_, point_light_direction) - point_light_direction;
     vec4 roughness = vec4(0.0);
-    if (has_specular_map) {
-        roughness = texture(specular_map, texcoord);
-    }
+#ifdef HAS_SPECULAR_MAP
+    roughness = texture(specular_map, texcoord);
+#endif
     float specular = pow(max(0.0, dot(reflected, normalize(camera_position - position))), 64.0) * (roughness[0] * roughness[3]);
 
     float light_distance = length(light_vector);
@@ -87,54 +173,56 @@ vec3 get_color(int idx, vec3 normal_) {
 
 void main()
 {
+#ifdef IS_REFLECTIVE
+    vec3 I      = normalize(camera_position - position);
+    vec3 reflect_normal = (model * vec4(normal, 0.0)).xyz;
+    vec3 reflection  = -reflect(I, reflect_normal);
+    vec3 coords = normalize(reflection);
+    out_color = vec4(texture(cubemap, coords).xyz, 1.0);
+#else
     vec3 normal_ = normal;
-    if (has_normal_map) {
-        normal_ = (normalize(texture(normal_map, texcoord) * 2.f - 1.f)).xyz;
-        normal_ = normalize((model * vec4(normal_, 0.0)).xyz);
-    }
-
-    vec4 shadow_coord = shadow_transform * vec4(position, 1.0);
-    shadow_coord /= shadow_coord.w; // perspective divide
-    shadow_coord = shadow_coord * 0.5 + vec4(0.5);
-    bool in_shadow = texture(shadow_map, shadow_coord.xy).r < shadow_coord.z;
+#ifdef HAS_NORMAL_MAP
+    // normal maps are BC5, only x and y are stored
+    vec2 normal_xy = texture(normal_map, texcoord).xy * 2.0 - 1.0;
+    vec3 tangent_normal = vec3(normal_xy, sqrt(max(0.0, 1.0 - dot(normal_xy, normal_xy))));
+    // MikkTSpace: the bitangent is rebuilt from the interpolated vectors without normalizing them first
+    vec3 bitangent = (tangent.w < 0.0 ? -1.0 : 1.0) * cross(normal, tangent.xyz);
+    normal_ = normalize(tangent_normal.x * tangent.xyz + tangent_normal.y * bitangent + tangent_normal.z * normal);
+#endif
 
-    vec3 reflected = 2.0 * normal_ * dot(normal_, light_direction) - light_direction;
-    vec4 roughness = vec4(0.0);
-    if (has_specular_map) {
-        roughness = texture(specular_map, texcoord);
+    // cascades are ordered from near to far, so the first one containing the fragment is the finest
+    bool in_shadow = false;
+    for (int i = 0; i < shadow_cascade_count; i++) {
+        vec4 shadow_coord = shadow_transform[i] * vec4(position, 1.0);
+        shadow_coord /= shadow_coord.w; // perspective divide
+        shadow_coord = shadow_coord * 0.5 + vec4(0.5);
+        if (all(greaterThan(shadow_coord.xyz, vec3(0.0))) && all(lessThan(shadow_coord.xyz, vec3(1.0)))) {
+            in_shadow = texture(shadow_map, vec3(shadow_coord.xy, float(i))).r < shadow_coord.z;
+            break;
+        }
     }
-    float specular_light = pow(max(0.0, dot(reflected, normalize(camera_position - position))), 4.0) * (roughness[0] * roughness[3]);
 
-    vec3 ambient = ambient_color * albedo * texture(tex, texcoord).xyz;
-    vec3 diffuse = diffuse_color * light_color * max(0.0, dot(normal_ , light_direction)) * texture(diffuse_map, texcoord).xyz;
-    vec3 specular = specular_light * texture(tex, texcoord).xyz;
-    vec3 point_light_colors = (get_color(0, normal_) + get_color(1, normal_) + get_color(2, normal_)) * texture(tex, texcoord).xyz;
+    vec4 albedo_texel = sample_albedo();
+    vec3 ambient = ambient_color * albedo * albedo_texel.xyz;
 	vec3 color = ambient;
-    if (has_diffuse_map) {
-        color = color + diffuse;
-    }
-    if (has_specular_map) {
-        color = color + specular;
-    }
 
-    if (in_shadow) {
-        color = ambient;
+    if (!in_shadow) {
+#ifdef HAS_DIFFUSE_MAP
+        color += diffuse_color * light_color * max(0.0, dot(normal_ , light_direction)) * texture(diffuse_map, texcoord).xyz;
+#endif
+#ifdef HAS_SPECULAR_MAP
+        vec3 reflected = 2.0 * normal_ * dot(normal_, light_direction) - light_direction;
+        vec4 roughness = texture(specular_map, texcoord);
+        float specular_light = pow(max(0.0, dot(reflected, normalize(camera_position - position))), 4.0) * (roughness[0] * roughness[3]);
+        color += specular_light * albedo_texel.xyz;
+#endif
     }
 
+    vec3 point_light_colors = (get_color(0, normal_) + get_color(1, normal_) + get_color(2, normal_)) * albedo_texel.xyz;
     color = color + point_light_colors;
 
-    out_color = vec4(color, 1.0);
-    out_color.a = texture(tex, texcoord).a;
-
-    if (is_reflective) {
-
-        vec3 I      = normalize(camera_position - position);
-        vec3 reflect_normal = (model * vec4(normal, 0.0)).xyz;
-        vec3 reflection  = -reflect(I, reflect_normal);
-        vec3 coords = normalize(reflection);
-        color   = texture(cubemap, coords).xyz;
-        out_color = vec4(color, 1.0);
-    }
+    out_color = vec4(color, albedo_texel.a);
+#endif
 }
 )";
 
@@ -143,12 +231,14 @@ const char new_vertex_shader_source[] =
 
 uniform mat4 model;
 uniform mat4 shadow_transform;
+uniform vec3 position_offset;
+uniform vec3 position_scale;
 
 layout (location = 0) in vec3 in_position;
 
 void main()
 {
-	gl_Position = shadow_transform * model * vec4(in_position, 1.0);
+	gl_Position = shadow_transform * model * vec4(position_offset + in_position * position_scale, 1.0);
 }
 )";
 
@@ -160,5 +250,60 @@ void main()
 }
 )";
 
+const char depth_vertex_shader_source[] =
+        R"(#version 330 core
+
+uniform mat4 model;
+uniform mat4 view;
+uniform mat4 projection;
+
+layout (location = 0) in vec3 in_position;
+#ifdef PACKED_VERTEX
+uniform vec3 position_offset;
+uniform vec3 position_scale;
+#endif
+
+// must produce bit-identical depth to vertex_shader_source for the GL_EQUAL color pass
+invariant gl_Position;
+
+void main()
+{
+#ifdef PACKED_VERTEX
+    vec3 object_position = position_offset + in_position * position_scale;
+#else
+    vec3 object_position = in_position;
+#endif
+	gl_Position = projection * view * model * vec4(object_position, 1.0);
+}
+)";
+
+const char feedback_fragment_shader_source[] =
+        R"(#version 330 core
+
+uniform int vt_texture;
+uniform vec2 vt_size;
+uniform int vt_levels;
+// log2 of how much smaller than the window the feedback target is
+uniform float vt_lod_bias;
+
+in vec2 texcoord;
+
+layout (location = 0) out vec4 out_feedback;
+
+void main()
+{
+    vec2 texel = texcoord * vt_size;
+    vec2 dx = dFdx(texel), dy = dFdy(texel);
+    int level = int(floor(max(0.0, 0.5 * log2(max(dot(dx, dx), dot(dy, dy))) - vt_lod_bias)));
+    if (vt_texture == 0 || level >= vt_levels) {
+        out_feedback = vec4(0.0);
+        return;
+    }
+
+    // packed as vt_pack() in VirtualTexture.h
+    ivec2 tile = ivec2(fract(texcoord) * vt_size / (128.0 * exp2(float(level))));
+    out_feedback = vec4(tile.x, tile.y, level + 16 * (vt_texture % 16), vt_texture / 16) / 255.0;
+}
+)";
 
 #endif
@@ -0,0 +1,220 @@
+#ifndef SPONZA_SCENE_TANGENTS_H
+#define SPONZA_SCENE_TANGENTS_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <utility>
+#include <vector>
+#include <glm/geometric.hpp>
+#include <glm/vec2.hpp>
+#include <glm/vec3.hpp>
+#include <glm/vec4.hpp>
+#include "AssetCache.h"
+
+
+// Tangent frames for normal mapping in the MikkTSpace convention: tangent.xyz points along increasing u and is
+// orthogonal to the vertex normal, tangent.w is the sign of the bitangent, which the shader rebuilds per pixel as
+// w * cross(normal, tangent) from the interpolated, unnormalized vectors. Each corner contributes the direction of
+// its face, projected into the tangent plane of its vertex and weighted by the corner angle. Faces with mirrored
+// texture coordinates have the opposite sign, so a vertex shared by both kinds is split in two.
+
+struct tangent_space {
+    // one per vertex, the split ones included
+    std::vector<glm::vec4> tangents;
+    // the vertex each split vertex copies, in the order they are appended
+    std::vector<std::uint32_t> split_sources;
+    // positions in the index buffer that move to a split vertex, and that vertex
+    std::vector<std::pair<std::uint32_t, std::uint32_t>> rewrites;
+};
+
+// Any unit vector orthogonal to normal, for vertices whose faces give no direction.
+inline glm::vec3 orthogonal_unit(glm::vec3 normal) {
+    glm::vec3 axis = std::abs(normal.x) < 0.9f ? glm::vec3(1.f, 0.f, 0.f) : glm::vec3(0.f, 1.f, 0.f);
+    glm::vec3 result = axis - normal * glm::dot(normal, axis);
+    return glm::normalize(result);
+}
+
+template <typename Vertex>
+tangent_space generate_tangents(std::vector<Vertex> const &vertices, std::vector<std::uint32_t> const &indices) {
+    const std::uint32_t unused = ~0u;
+    std::size_t triangle_count = indices.size() / 3;
+
+    // direction of increasing u and v of a face, and +1, -1 or 0 for faces without a usable texture mapping;
+    // recomputed where needed rather than kept for every face, which would take 24 bytes per triangle
+    struct face_frame {
+        glm::vec3 s = glm::vec3(0.f), t = glm::vec3(0.f);
+        int sign = 0;
+    };
+    auto frame = [&](std::size_t f) {
+        face_frame result;
+        Vertex const &a = vertices[indices[3 * f]], &b = vertices[indices[3 * f + 1]], &c = vertices[indices[3 * f + 2]];
+        glm::vec3 e1 = b.position - a.position, e2 = c.position - a.position;
+        glm::vec2 d1 = b.texcoord - a.texcoord, d2 = c.texcoord - a.texcoord;
+        float area = d1.x * d2.y - d2.x * d1.y;
+        if (std::abs(area) <= std::numeric_limits<float>::min() || glm::length(glm::cross(e1, e2)) == 0.f)
+            return result;
+        result.sign = area > 0.f ? 1 : -1;
+        // the magnitudes don't matter, only the directions are accumulated
+        result.s = (e1 * d2.y - e2 * d1.y) * float(result.sign);
+        result.t = (e2 * d1.x - e1 * d2.x) * float(result.sign);
+        return result;
+    };
+    std::vector<std::int8_t> face_sign(triangle_count);
+    for (std::size_t f = 0; f < triangle_count; f++)
+        face_sign[f] = std::int8_t(frame(f).sign);
+
+    // slot[2 * v + (sign < 0)] is the vertex that the corners of v with that sign end up on
+    tangent_space space;
+    std::vector<std::uint32_t> slot(vertices.size() * 2, unused);
+    std::vector<std::uint32_t> corner_vertex(triangle_count * 3);
+    for (std::size_t i = 0; i < triangle_count * 3; i++) {
+        std::uint32_t v = indices[i];
+        int sign = face_sign[i / 3];
+        corner_vertex[i] = v;
+        if (sign == 0)
+            continue;
+        std::uint32_t &target = slot[2 * v + (sign < 0)];
+        if (target == unused) {
+            if (slot[2 * v + (sign > 0)] == unused) {
+                target = v;
+            } else {
+                target = std::uint32_t(vertices.size() + space.split_sources.size());
+                space.split_sources.push_back(v);
+            }
+        }
+        corner_vertex[i] = target;
+        if (target != v)
+            space.rewrites.emplace_back(std::uint32_t(i), target);
+    }
+    slot = std::vector<std::uint32_t>();
+
+    std::size_t vertex_count = vertices.size() + space.split_sources.size();
+    auto source = [&](std::uint32_t v) -> Vertex const & {
+        return vertices[v < vertices.size() ? v : space.split_sources[v - vertices.size()]];
+    };
+    std::vector<glm::vec3> sum_s(vertex_count, glm::vec3(0.f)), sum_t(vertex_count, glm::vec3(0.f));
+    std::vector<std::int8_t> signs(vertex_count, 1);
+    face_frame face;
+    for (std::size_t i = 0; i < triangle_count * 3; i++) {
+        std::size_t f = i / 3;
+        if (face_sign[f] == 0)
+            continue;
+        if (i % 3 == 0)
+            face = frame(f);
+        std::uint32_t v = corner_vertex[i];
+        glm::vec3 normal = source(v).normal;
+        glm::vec3 p = source(v).position;
+        glm::vec3 to_next = vertices[indices[f * 3 + (i + 1) % 3]].position - p;
+        glm::vec3 to_previous = vertices[indices[f * 3 + (i + 2) % 3]].position - p;
+        float lengths = glm::length(to_next) * glm::length(to_previous);
+        if (lengths == 0.f)
+            continue;
+        float angle = std::acos(std::clamp(glm::dot(to_next, to_previous) / lengths, -1.f, 1.f));
+
+        auto project = [&](glm::vec3 direction) {
+            direction -= normal * glm::dot(normal, direction);
+            float length = glm::length(direction);
+            return length > 0.f ? direction / length : glm::vec3(0.f);
+        };
+        sum_s[v] += project(face.s) * angle;
+        sum_t[v] += project(face.t) * angle;
+        signs[v] = face_sign[f];
+    }
+
+    space.tangents.resize(vertex_count);
+    for (std::size_t v = 0; v < vertex_count; v++) {
+        glm::vec3 normal = source(std::uint32_t(v)).normal;
+        float normal_length = glm::length(normal);
+        normal = normal_length > 0.f ? normal / normal_length : glm::vec3(0.f, 0.f, 1.f);
+        glm::vec3 s = sum_s[v] - normal * glm::dot(normal, sum_s[v]);
+        if (glm::length(s) <= 1e-6f) {
+            // falls back to the v direction, or anything if the faces give none
+            glm::vec3 t = sum_t[v] - normal * glm::dot(normal, sum_t[v]);
+            s = glm::length(t) > 1e-6f ? glm::cross(t, normal) * float(signs[v]) : orthogonal_unit(normal);
+        }
+        space.tangents[v] = glm::vec4(glm::normalize(s), float(signs[v]));
+    }
+    return space;
+}
+
+// An empty tangent space leaves the object as it is; otherwise tangents gets one per vertex. Taken by value so that
+// a moved-in space hands over its tangents and is released right after.
+template <typename Vertex>
+void apply_tangent_space(std::vector<Vertex> &vertices, std::vector<std::uint32_t> &indices,
+                         std::vector<glm::vec4> &tangents, tangent_space space) {
+    if (space.tangents.empty())
+        return;
+    vertices.reserve(vertices.size() + space.split_sources.size());
+    for (std::uint32_t v: space.split_sources)
+        vertices.push_back(vertices[v]);
+    for (auto [position, v]: space.rewrites)
+        indices[position] = v;
+    tangents = std::move(space.tangents);
+}
+
+const std::uint32_t tangent_cache_magic = 0x54414e31; // "TAN1"
+
+// vertex and index count of an object before splitting, which a cache entry has to match
+using tangent_mesh_size = std::pair<std::uint32_t, std::uint32_t>;
+
+// Fills the tangent space of every object; returns false unless the entry at path is complete and for these sizes.
+inline bool load_cached_tangents(std::filesystem::path const &path, std::vector<tangent_mesh_size> const &sizes,
+                                 std::vector<tangent_space> &spaces) {
+    std::ifstream file(path, std::ios::binary);
+    std::uint32_t magic = 0, object_count = 0;
+    if (!read_value(file, magic) || magic != tangent_cache_magic || !read_value(file, object_count)
+        || object_count != sizes.size())
+        return false;
+
+    spaces.assign(object_count, {});
+    for (std::size_t object = 0; object < object_count; object++) {
+        tangent_mesh_size size;
+        std::uint32_t split_count = 0, rewrite_count = 0, has_tangents = 0;
+        if (!read_value(file, size.first) || !read_value(file, size.second) || size != sizes[object]
+            || !read_value(file, split_count) || !read_value(file, rewrite_count) || !read_value(file, has_tangents))
+            return false;
+        tangent_space &space = spaces[object];
+        space.split_sources.resize(split_count);
+        space.rewrites.resize(rewrite_count);
+        space.tangents.resize(has_tangents ? size.first + split_count : 0);
+        if (!file.read(reinterpret_cast<char *>(space.split_sources.data()), split_count * sizeof(std::uint32_t))
+            || !file.read(reinterpret_cast<char *>(space.rewrites.data()), rewrite_count * sizeof(space.rewrites[0]))
+            || !file.read(reinterpret_cast<char *>(space.tangents.data()), space.tangents.size() * sizeof(glm::vec4)))
+            return false;
+    }
+    return true;
+}
+
+inline void save_cached_tangents(std::filesystem::path const &path, std::vector<tangent_mesh_size> const &sizes,
+                                 std::vector<tangent_space> const &spaces) {
+    std::error_code error;
+    std::filesystem::create_directories(path.parent_path(), error);
+    std::filesystem::path temporary = path;
+    temporary += ".tmp";
+    {
+        std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+        write_value(file, tangent_cache_magic);
+        write_value(file, std::uint32_t(sizes.size()));
+        for (std::size_t object = 0; object < sizes.size(); object++) {
+            tangent_space const &space = spaces[object];
+            write_value(file, sizes[object].first);
+            write_value(file, sizes[object].second);
+            write_value(file, std::uint32_t(space.split_sources.size()));
+            write_value(file, std::uint32_t(space.rewrites.size()));
+            write_value(file, std::uint32_t(!space.tangents.empty()));
+            file.write(reinterpret_cast<const char *>(space.split_sources.data()), space.split_sources.size() * sizeof(std::uint32_t));
+            file.write(reinterpret_cast<const char *>(space.rewrites.data()), space.rewrites.size() * sizeof(space.rewrites[0]));
+            file.write(reinterpret_cast<const char *>(space.tangents.data()), space.tangents.size() * sizeof(glm::vec4));
+        }
+        if (!file)
+            return;
+    }
+    std::filesystem::rename(temporary, path, error);
+}
+
+
+#endif
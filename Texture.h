@@ -0,0 +1,57 @@
+#ifndef SPONZA_SCENE_TEXTURE_H
+#define SPONZA_SCENE_TEXTURE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+
+// how materials sample a texture file, in increasing order of precedence when several do
+enum TextureUsage : std::uint32_t {
+    TEXTURE_COLOR = 0,
+    TEXTURE_DATA = 1,
+    TEXTURE_NORMAL = 2,
+};
+
+// layout of the bytes in texture::levels
+enum TextureEncoding : std::uint32_t {
+    TEXTURE_RAW = 0,
+    TEXTURE_BC1 = 1,
+    TEXTURE_BC3 = 2,
+    TEXTURE_BC4 = 3,
+    TEXTURE_BC5 = 4,
+};
+
+struct texture {
+    // resolved file name, identifies the texture across objects and models
+    std::string path;
+    int width = 0, height = 0, channels = 0;
+    // color data is sRGB encoded; normal and specular maps are not
+    bool srgb = false;
+    TextureEncoding encoding = TEXTURE_RAW;
+    // the full mip chain, levels[0] is the image itself
+    std::vector<std::vector<unsigned char>> levels;
+
+    int level_width(std::size_t level) const {
+        return std::max(1, width >> level);
+    }
+
+    int level_height(std::size_t level) const {
+        return std::max(1, height >> level);
+    }
+
+    std::size_t raw_level_size(std::size_t level) const {
+        return std::size_t(level_width(level)) * level_height(level) * channels;
+    }
+
+    std::size_t level_size(std::size_t level) const {
+        if (encoding == TEXTURE_RAW)
+            return raw_level_size(level);
+        std::size_t blocks = std::size_t((level_width(level) + 3) / 4) * ((level_height(level) + 3) / 4);
+        return blocks * (encoding == TEXTURE_BC1 || encoding == TEXTURE_BC4 ? 8 : 16);
+    }
+};
+
+
+#endif
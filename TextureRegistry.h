@@ -0,0 +1,255 @@
+#ifndef SPONZA_SCENE_TEXTUREREGISTRY_H
+#define SPONZA_SCENE_TEXTUREREGISTRY_H
+
+#include <GL/glew.h>
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "Texture.h"
+#include "TextureUploader.h"
+
+
+// Creates one GL texture per file and hands the same name out to every object that references it.
+//
+// It also keeps the textures within a memory budget. Draws stamp the frame each texture was last used in; while
+// the resident levels exceed the budget, the top level of the coldest texture is dropped by raising
+// GL_TEXTURE_BASE_LEVEL and redefining the level empty. Textures used recently get their levels back, one per
+// frame and only while they fit, re-uploaded from the decoded levels kept in memory.
+class TextureRegistry {
+public:
+    struct texture_format {
+        GLint internal_format;
+        GLenum format;
+        // where the shader's r, g, b and a come from
+        GLint swizzle[4];
+    };
+
+    // Grey and grey-alpha images stay one and two channels in memory and are swizzled back to grey RGB when sampled.
+    // Makes no GL calls, so bake checks it on the CPU.
+    static texture_format format_of(texture const &source) {
+        bool srgb = source.srgb && srgb_sampling;
+        texture_format f = {0, 0, {GL_RED, GL_GREEN, GL_BLUE, GL_ALPHA}};
+        switch (source.channels) {
+            case 1:
+                f = {GL_R8, GL_RED, {GL_RED, GL_RED, GL_RED, GL_ONE}};
+                break;
+            case 2:
+                f = {GL_RG8, GL_RG, {GL_RED, GL_RED, GL_RED, GL_GREEN}};
+                break;
+            case 3:
+                f.internal_format = srgb ? GL_SRGB8 : GL_RGB8;
+                f.format = GL_RGB;
+                break;
+            case 4:
+                f.internal_format = srgb ? GL_SRGB8_ALPHA8 : GL_RGBA8;
+                f.format = GL_RGBA;
+                break;
+            default:
+                throw std::runtime_error("Unsupported texture channel count: " + source.path);
+        }
+
+        switch (source.encoding) {
+            case TEXTURE_BC1:
+                f.internal_format = srgb ? GL_COMPRESSED_SRGB_S3TC_DXT1_EXT : GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+                break;
+            case TEXTURE_BC3:
+                f.internal_format = srgb ? GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT : GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+                break;
+            case TEXTURE_BC4:
+                f.internal_format = GL_COMPRESSED_RED_RGTC1;
+                break;
+            case TEXTURE_BC5:
+                f.internal_format = GL_COMPRESSED_RG_RGTC2;
+                break;
+            default:
+                break;
+        }
+        return f;
+    }
+
+private:
+    struct entry {
+        GLuint name;
+        texture const *source;
+        texture_format format;
+        std::size_t bytes, resident_bytes;
+        // levels below base_level are not resident; a level being streamed in becomes the base once its upload
+        // with ticket is issued
+        std::size_t base_level = 0, target_level = 0;
+        std::uint64_t ticket = 0;
+        std::uint64_t last_used = 0;
+    };
+
+    // frames a texture stays hot after its last draw
+    static const std::uint64_t recent_frames = 120;
+
+    TextureUploader &uploader;
+    std::map<std::string, entry> entries;
+    std::size_t total_bytes = 0, total_raw_bytes = 0, total_resident_bytes = 0;
+
+    void create(texture const &source, entry &e) {
+        texture_format f = format_of(source);
+        if ((source.encoding == TEXTURE_BC1 || source.encoding == TEXTURE_BC3) && !GLEW_EXT_texture_compression_s3tc)
+            throw std::runtime_error("S3TC texture compression is not supported: " + source.path);
+
+        glGenTextures(1, &e.name);
+        glBindTexture(GL_TEXTURE_2D, e.name);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_RGBA, f.swizzle);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, GLint(source.levels.size()) - 1);
+        e.source = &source;
+        e.format = f;
+        // the levels arrive asynchronously; until the last one has the texture is incomplete and samples as black
+        e.bytes = 0;
+        for (std::size_t level = 0; level < source.levels.size(); level++) {
+            e.ticket = upload_level(e, level);
+            e.bytes += source.levels[level].size();
+            total_raw_bytes += source.raw_level_size(level);
+        }
+        e.resident_bytes = e.bytes;
+    }
+
+    std::uint64_t upload_level(entry const &e, std::size_t level) {
+        texture const &source = *e.source;
+        return uploader.upload({e.name, GLint(level), e.format.internal_format, e.format.format,
+                                source.level_width(level), source.level_height(level),
+                                source.levels[level].data(), source.levels[level].size(),
+                                source.encoding != TEXTURE_RAW});
+    }
+
+    // nothing queued for the texture and at least two levels resident
+    bool can_drop(entry const &e) const {
+        return e.base_level == e.target_level && uploader.issued(e.ticket)
+               && e.base_level + 1 < e.source->levels.size();
+    }
+
+    void drop_level(entry &e) {
+        std::size_t level = e.base_level;
+        glBindTexture(GL_TEXTURE_2D, e.name);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, GLint(level + 1));
+        if (e.source->encoding != TEXTURE_RAW)
+            glCompressedTexImage2D(GL_TEXTURE_2D, GLint(level), e.format.internal_format, 0, 0, 0, 0, nullptr);
+        else
+            glTexImage2D(GL_TEXTURE_2D, GLint(level), e.format.internal_format, 0, 0, 0, e.format.format,
+                         GL_UNSIGNED_BYTE, nullptr);
+        e.base_level = e.target_level = level + 1;
+        e.resident_bytes -= e.source->levels[level].size();
+        total_resident_bytes -= e.source->levels[level].size();
+        dropped_levels++;
+    }
+
+    void stream_in_level(entry &e) {
+        e.target_level = e.base_level - 1;
+        e.ticket = upload_level(e, e.target_level);
+        e.resident_bytes += e.source->levels[e.target_level].size();
+        total_resident_bytes += e.source->levels[e.target_level].size();
+        streamed_levels++;
+    }
+
+public:
+    // Color textures are sampled as sRGB only if set; the shaders light in gamma space, so it is off by default.
+    static inline bool srgb_sampling = false;
+
+    // the frame draws stamp into the textures they bind, advanced by update()
+    static inline std::uint64_t frame = 1;
+
+    // what uploading once per reference, as every Object used to do, would cost
+    std::size_t references = 0, referenced_bytes = 0;
+    std::size_t budget;
+    std::size_t dropped_levels = 0, streamed_levels = 0;
+
+    explicit TextureRegistry(TextureUploader &uploader, std::size_t budget = std::numeric_limits<std::size_t>::max())
+            : uploader(uploader), budget(budget) {}
+
+    // source must outlive the registry, levels are streamed in from it again after they were dropped
+    GLuint acquire(texture const &source) {
+        auto it = entries.find(source.path);
+        if (it == entries.end()) {
+            it = entries.emplace(source.path, entry{}).first;
+            create(source, it->second);
+            total_bytes += it->second.bytes;
+            total_resident_bytes += it->second.resident_bytes;
+        }
+        references++;
+        referenced_bytes += it->second.bytes;
+        return it->second.name;
+    }
+
+    // where draws binding the texture stamp the current frame
+    std::uint64_t *last_used(texture const &source) {
+        return &entries.at(source.path).last_used;
+    }
+
+    // Call once per frame, after TextureUploader::process().
+    void update() {
+        for (auto &[path, e]: entries) {
+            if (e.base_level != e.target_level && uploader.issued(e.ticket)) {
+                glBindTexture(GL_TEXTURE_2D, e.name);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, GLint(e.target_level));
+                e.base_level = e.target_level;
+            }
+        }
+
+        // coldest first, the largest level among equally cold ones
+        while (total_resident_bytes > budget) {
+            entry *victim = nullptr;
+            for (auto &[path, e]: entries) {
+                if (!can_drop(e))
+                    continue;
+                if (victim == nullptr || e.last_used < victim->last_used
+                    || (e.last_used == victim->last_used && e.source->levels[e.base_level].size()
+                                                            > victim->source->levels[victim->base_level].size()))
+                    victim = &e;
+            }
+            if (victim == nullptr)
+                break;
+            drop_level(*victim);
+        }
+
+        // a level dropped to meet the budget never fits back until something else is dropped, so this does not thrash
+        for (auto &[path, e]: entries) {
+            if (e.base_level == 0 || e.base_level != e.target_level || e.last_used + recent_frames < frame)
+                continue;
+            if (total_resident_bytes + e.source->levels[e.base_level - 1].size() <= budget)
+                stream_in_level(e);
+        }
+        frame++;
+    }
+
+    void dump(std::ostream &out) const {
+        out << "Texture residency: " << total_resident_bytes / 1024 << " KB resident of " << total_bytes / 1024
+            << " KB, budget " << (budget == std::numeric_limits<std::size_t>::max() ? std::string("none")
+                                                                                    : std::to_string(budget / 1024) + " KB")
+            << ", " << dropped_levels << " levels dropped, " << streamed_levels << " streamed back" << std::endl;
+        for (auto &[path, e]: entries) {
+            out << "  " << path << ": " << e.resident_bytes / 1024 << " / " << e.bytes / 1024 << " KB, levels "
+                << e.base_level << ".." << e.source->levels.size() - 1 << ", last used "
+                << frame - e.last_used << " frames ago" << std::endl;
+        }
+    }
+
+    std::size_t texture_count() const {
+        return entries.size();
+    }
+
+    std::size_t bytes() const {
+        return total_bytes;
+    }
+
+    std::size_t resident_bytes() const {
+        return total_resident_bytes;
+    }
+
+    // what the same textures would take uncompressed
+    std::size_t raw_bytes() const {
+        return total_raw_bytes;
+    }
+};
+
+
+#endif
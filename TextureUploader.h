@@ -0,0 +1,190 @@
+#ifndef SPONZA_SCENE_TEXTUREUPLOADER_H
+#define SPONZA_SCENE_TEXTUREUPLOADER_H
+
+#include <GL/glew.h>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <future>
+
+
+// One image of a GL_TEXTURE_2D queued in TextureUploader; data must stay alive until the uploader is idle.
+struct texture_image {
+    GLuint name;
+    GLint level;
+    GLint internal_format;
+    GLenum format;
+    int width, height;
+    const unsigned char *data;
+    std::size_t size;
+    // data is in the block compressed internal_format and format is unused
+    bool compressed = false;
+};
+
+// Streams texels to GL textures through a ring buffer of pixel unpack memory. With ARB_buffer_storage the ring is
+// persistently mapped and worker threads copy the texels into it; the render thread issues glTexImage2D from the
+// buffer once a copy is done and fences the region, so it is reused only after the GPU has consumed it. Without
+// buffer storage the copy happens on the render thread through an unsynchronized mapping.
+class TextureUploader {
+private:
+    struct Region {
+        std::size_t begin, end;
+        GLsync fence = nullptr;
+    };
+
+    struct Upload {
+        texture_image image;
+        Region *region = nullptr;
+        // too large for the ring, uploaded straight from image.data
+        bool direct = false;
+        std::future<void> copy;
+    };
+
+    GLuint buffer = 0;
+    std::size_t capacity;
+    std::size_t head = 0;
+    unsigned char *mapped = nullptr;
+    bool persistent;
+    // regions in allocation order, oldest first
+    std::deque<Region> regions;
+    // waiting for ring space, then for the copy to finish
+    std::deque<Upload> uploads;
+    std::uint64_t submitted = 0, completed = 0;
+
+    bool overlaps(std::size_t begin, std::size_t end) const {
+        for (Region const &r: regions) {
+            if (begin < r.end && r.begin < end)
+                return true;
+        }
+        return false;
+    }
+
+    // Frees the oldest regions the GPU is done with.
+    void retire() {
+        while (!regions.empty() && regions.front().fence != nullptr) {
+            GLenum status = glClientWaitSync(regions.front().fence, 0, 0);
+            if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+                break;
+            glDeleteSync(regions.front().fence);
+            regions.pop_front();
+        }
+    }
+
+    Region *reserve(std::size_t size) {
+        std::size_t begin = head + size > capacity ? 0 : head;
+        if (overlaps(begin, begin + size)) {
+            retire();
+            if (overlaps(begin, begin + size))
+                return nullptr;
+        }
+        // keep every upload 256-byte aligned
+        head = (begin + size + 255) & ~std::size_t(255);
+        regions.push_back({begin, begin + size});
+        return &regions.back();
+    }
+
+    void start_copy(Upload &upload) {
+        if (persistent) {
+            unsigned char *destination = mapped + upload.region->begin;
+            texture_image image = upload.image;
+            upload.copy = std::async(std::launch::async, [destination, image] {
+                std::memcpy(destination, image.data, image.size);
+            });
+            return;
+        }
+
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+        void *destination = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, upload.region->begin, upload.image.size,
+                                             GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+        std::memcpy(destination, upload.image.data, upload.image.size);
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    }
+
+    static void issue_image(texture_image const &image, const void *pixels) {
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glBindTexture(GL_TEXTURE_2D, image.name);
+        if (image.compressed) {
+            glCompressedTexImage2D(GL_TEXTURE_2D, image.level, image.internal_format, image.width, image.height, 0,
+                                   GLsizei(image.size), pixels);
+            return;
+        }
+        glTexImage2D(GL_TEXTURE_2D, image.level, image.internal_format, image.width, image.height, 0,
+                     image.format, GL_UNSIGNED_BYTE, pixels);
+    }
+
+    void issue(Upload &upload) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+        issue_image(upload.image, reinterpret_cast<void *>(upload.region->begin));
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        upload.region->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        pbo_uploads++;
+    }
+
+public:
+    std::size_t pbo_uploads = 0, direct_uploads = 0;
+
+    explicit TextureUploader(std::size_t capacity = std::size_t(64) << 20) : capacity(capacity) {
+        persistent = GLEW_ARB_buffer_storage || GLEW_VERSION_4_4;
+
+        glGenBuffers(1, &buffer);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+        if (persistent) {
+            GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+            glBufferStorage(GL_PIXEL_UNPACK_BUFFER, capacity, nullptr, flags);
+            mapped = static_cast<unsigned char *>(glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, capacity, flags));
+        } else {
+            glBufferData(GL_PIXEL_UNPACK_BUFFER, capacity, nullptr, GL_STREAM_DRAW);
+        }
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    }
+
+    // Returns a ticket for issued(); images are issued in the order they were queued.
+    std::uint64_t upload(texture_image const &image) {
+        uploads.push_back({image, nullptr, image.size > capacity, {}});
+        return ++submitted;
+    }
+
+    // Call once per frame on the render thread.
+    void process() {
+        retire();
+        for (Upload &upload: uploads) {
+            if (upload.region != nullptr || upload.direct)
+                continue;
+            upload.region = reserve(upload.image.size);
+            if (upload.region == nullptr)
+                break;
+            start_copy(upload);
+        }
+
+        // issue in order, so the regions are fenced in allocation order too
+        while (!uploads.empty() && (uploads.front().region != nullptr || uploads.front().direct)) {
+            Upload &upload = uploads.front();
+            if (upload.copy.valid()) {
+                if (upload.copy.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+                    break;
+                upload.copy.get();
+            }
+            if (upload.direct) {
+                issue_image(upload.image, upload.image.data);
+                direct_uploads++;
+            } else {
+                issue(upload);
+            }
+            uploads.pop_front();
+            completed++;
+        }
+    }
+
+    bool idle() const {
+        return uploads.empty();
+    }
+
+    bool issued(std::uint64_t ticket) const {
+        return completed >= ticket;
+    }
+};
+
+
+#endif
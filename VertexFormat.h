@@ -0,0 +1,135 @@
+#ifndef SPONZA_SCENE_VERTEXFORMAT_H
+#define SPONZA_SCENE_VERTEXFORMAT_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <glm/common.hpp>
+#include <glm/geometric.hpp>
+#include <glm/gtc/constants.hpp>
+#include <glm/gtc/packing.hpp>
+#include <glm/vec2.hpp>
+#include <glm/vec3.hpp>
+#include <glm/vec4.hpp>
+
+
+// The packed vertex layout, a third of the size of vertex: positions are 16-bit normalized relative to the object
+// bounds (decoded as position_offset + position * position_scale, like the quantized depth stream), normals are
+// octahedral in two 16-bit snorms, tangents an angle in the plane of the decoded normal and texcoords half floats.
+struct packed_vertex {
+    // w is the tangent, see encode_tangent
+    std::uint16_t position[4];
+    std::int16_t normal[2];
+    std::uint16_t texcoord[2];
+};
+
+static_assert(sizeof(packed_vertex) == 16);
+
+inline std::uint16_t quantize_unorm16(float value) {
+    return std::uint16_t(std::lround(std::clamp(value, 0.f, 1.f) * 65535.f));
+}
+
+inline std::int16_t quantize_snorm16(float value) {
+    return std::int16_t(std::lround(std::clamp(value, -1.f, 1.f) * 32767.f));
+}
+
+// Maps the unit sphere onto the [-1, 1]^2 square: the upper hemisphere to the inner diamond, the lower one folded
+// over the corners.
+inline glm::vec2 octahedral_encode(glm::vec3 n) {
+    n /= std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+    if (n.z >= 0.f)
+        return {n.x, n.y};
+    return {(1.f - std::abs(n.y)) * (n.x >= 0.f ? 1.f : -1.f), (1.f - std::abs(n.x)) * (n.y >= 0.f ? 1.f : -1.f)};
+}
+
+// same as octahedral_decode in vertex_shader_source
+inline glm::vec3 octahedral_decode(glm::vec2 e) {
+    glm::vec3 n(e.x, e.y, 1.f - std::abs(e.x) - std::abs(e.y));
+    float t = std::max(-n.z, 0.f);
+    n.x += n.x >= 0.f ? -t : t;
+    n.y += n.y >= 0.f ? -t : t;
+    return glm::normalize(n);
+}
+
+// Orthonormal basis of the plane orthogonal to the unit normal n (Duff et al. 2017). upper is the hemisphere n was
+// octahedral encoded in, decided on the quantized integers so that tangent_decode in the vertex shader always picks
+// the same one, even for normals on the equator; same as tangent_basis there.
+inline void tangent_basis(glm::vec3 n, bool upper, glm::vec3 &b1, glm::vec3 &b2) {
+    float sign = upper ? 1.f : -1.f;
+    float a = -1.f / (sign + n.z);
+    float b = n.x * n.y * a;
+    b1 = {1.f + sign * n.x * n.x * a, sign * b, -sign * n.x};
+    b2 = {b, sign + n.y * n.y * a, -n.y};
+}
+
+inline bool octahedral_upper(const std::int16_t normal[2]) {
+    return std::abs(int(normal[0])) + std::abs(int(normal[1])) <= 32767;
+}
+
+// The angle of the tangent in the basis of the decoded normal in the upper 15 bits, the bitangent sign in bit 0.
+inline std::uint16_t encode_tangent(glm::vec4 tangent, glm::vec3 decoded_normal, bool upper) {
+    glm::vec3 b1, b2;
+    tangent_basis(decoded_normal, upper, b1, b2);
+    float angle = std::atan2(glm::dot(glm::vec3(tangent), b2), glm::dot(glm::vec3(tangent), b1));
+    auto step = std::uint32_t(std::lround(angle / glm::two_pi<float>() * 32768.f + 32768.f)) % 32768;
+    return std::uint16_t(step << 1 | (tangent.w < 0.f ? 1 : 0));
+}
+
+inline glm::vec4 decode_tangent(std::uint16_t bits, glm::vec3 decoded_normal, bool upper) {
+    glm::vec3 b1, b2;
+    tangent_basis(decoded_normal, upper, b1, b2);
+    float angle = float(bits >> 1) * glm::two_pi<float>() / 32768.f;
+    return {std::cos(angle) * b1 + std::sin(angle) * b2, (bits & 1) ? -1.f : 1.f};
+}
+
+// Largest differences between float vertices and their packed form.
+struct vertex_packing_error {
+    // in model units, degrees and texcoord units
+    float position = 0.f, normal = 0.f, tangent = 0.f, texcoord = 0.f;
+
+    void extend(vertex_packing_error const &other) {
+        position = std::max(position, other.position);
+        normal = std::max(normal, other.normal);
+        tangent = std::max(tangent, other.tangent);
+        texcoord = std::max(texcoord, other.texcoord);
+    }
+};
+
+// Packs one vertex and records its error; a zero tangent (no normal map) is packed as any tangent.
+inline packed_vertex pack_vertex(glm::vec3 position, glm::vec3 normal, glm::vec4 tangent, glm::vec2 texcoord,
+                                 glm::vec3 position_offset, glm::vec3 position_scale, vertex_packing_error &error) {
+    packed_vertex result = {};
+    glm::vec3 relative = (position - position_offset) / position_scale;
+    for (int c = 0; c < 3; c++)
+        result.position[c] = quantize_unorm16(relative[c]);
+    glm::vec3 decoded_position = position_offset + glm::vec3(result.position[0], result.position[1],
+                                                             result.position[2]) / 65535.f * position_scale;
+    error.position = std::max(error.position, glm::length(decoded_position - position));
+
+    float length = glm::length(normal);
+    glm::vec3 unit = length > 0.f ? normal / length : glm::vec3(0.f, 0.f, 1.f);
+    glm::vec2 octahedral = octahedral_encode(unit);
+    result.normal[0] = quantize_snorm16(octahedral.x);
+    result.normal[1] = quantize_snorm16(octahedral.y);
+    glm::vec3 decoded_normal = octahedral_decode(glm::vec2(result.normal[0], result.normal[1]) / 32767.f);
+    float angle = std::acos(std::clamp(glm::dot(decoded_normal, unit), -1.f, 1.f));
+    error.normal = std::max(error.normal, glm::degrees(angle));
+
+    bool upper = octahedral_upper(result.normal);
+    result.position[3] = encode_tangent(tangent, decoded_normal, upper);
+    glm::vec3 tangent_direction = glm::vec3(tangent) - unit * glm::dot(unit, glm::vec3(tangent));
+    if (glm::length(tangent_direction) > 0.f) {
+        glm::vec3 decoded_tangent = decode_tangent(result.position[3], decoded_normal, upper);
+        float tangent_angle = std::acos(std::clamp(glm::dot(decoded_tangent, glm::normalize(tangent_direction)), -1.f, 1.f));
+        error.tangent = std::max(error.tangent, glm::degrees(tangent_angle));
+    }
+
+    for (int c = 0; c < 2; c++) {
+        result.texcoord[c] = glm::packHalf1x16(texcoord[c]);
+        error.texcoord = std::max(error.texcoord, std::abs(glm::unpackHalf1x16(result.texcoord[c]) - texcoord[c]));
+    }
+    return result;
+}
+
+
+#endif
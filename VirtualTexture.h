@@ -0,0 +1,296 @@
+#ifndef SPONZA_SCENE_VIRTUALTEXTURE_H
+#define SPONZA_SCENE_VIRTUALTEXTURE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <list>
+#include <set>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+#include "AssetCache.h"
+#include "BlockCompression.h"
+#include "Mipmaps.h"
+
+// CPU half of virtual texturing, no GL involved, so it runs just as well on a simulated feedback buffer.
+//
+// A virtual texture is cut into 128x128 tiles per mip level, each stored with a 4 texel border (wrapped around the
+// texture edges, as the materials repeat) as a 136x136 BC3 block in a tiled file in the asset cache. Resident
+// tiles occupy slots of a physical atlas. The page table has one entry per tile and level: the slot and level of
+// the tile itself if it is resident, otherwise that of its nearest resident ancestor.
+
+const int vt_tile_size = 128;
+const int vt_tile_border = 4;
+const int vt_slot_size = vt_tile_size + 2 * vt_tile_border;
+const std::size_t vt_tile_bytes = std::size_t(vt_slot_size / 4) * (vt_slot_size / 4) * 16;
+const std::uint32_t vt_file_magic = 0x56545431; // "VTT1"
+
+// A requested tile as the feedback pass writes it: RGBA8 x, y, level | texture << 4, texture >> 4, read back as
+// one little-endian word. Texture 0 means no virtual texture.
+struct vt_tile {
+    std::uint32_t texture, level, x, y;
+};
+
+inline std::uint32_t vt_pack(vt_tile tile) {
+    return tile.x | tile.y << 8 | (tile.level | (tile.texture & 15) << 4) << 16 | (tile.texture >> 4) << 24;
+}
+
+inline vt_tile vt_unpack(std::uint32_t key) {
+    return {(key >> 20), (key >> 16) & 15, key & 255, (key >> 8) & 255};
+}
+
+// mip levels whose size is a whole number of tiles, counted from the top; 0 if the texture can't be virtual
+inline int vt_level_count(int width, int height) {
+    int levels = 0;
+    while ((width >> levels) >= vt_tile_size && (height >> levels) >= vt_tile_size
+           && (width >> levels) % vt_tile_size == 0 && (height >> levels) % vt_tile_size == 0 && levels < 16)
+        levels++;
+    return levels;
+}
+
+struct vt_file_header {
+    std::uint32_t magic;
+    std::int32_t width, height;
+    std::uint32_t levels;
+
+    std::size_t tiles_x(std::uint32_t level) const {
+        return std::size_t(width >> level) / vt_tile_size;
+    }
+
+    std::size_t tiles_y(std::uint32_t level) const {
+        return std::size_t(height >> level) / vt_tile_size;
+    }
+
+    std::size_t offset(vt_tile tile) const {
+        std::size_t index = 0;
+        for (std::uint32_t level = 0; level < tile.level; level++)
+            index += tiles_x(level) * tiles_y(level);
+        index += tile.y * tiles_x(tile.level) + tile.x;
+        return sizeof(vt_file_header) + index * vt_tile_bytes;
+    }
+};
+
+// Writes the tiled file of an image unless the asset cache has it already; returns its path.
+inline std::filesystem::path bake_virtual_texture(std::string const &filename, bool srgb) {
+    auto path = asset_cache_path(filename, srgb ? "virtual tiles srgb" : "virtual tiles linear");
+    if (std::filesystem::exists(path))
+        return path;
+
+    texture t;
+    t.path = filename;
+    t.srgb = srgb;
+    unsigned char *pixels = stbi_load(filename.c_str(), &t.width, &t.height, &t.channels, 0);
+    if (pixels == nullptr)
+        throw std::runtime_error("Texture loading failed: " + filename);
+    t.levels.emplace_back(pixels, pixels + t.width * t.height * t.channels);
+    stbi_image_free(pixels);
+    generate_mipmaps(t);
+
+    vt_file_header header = {vt_file_magic, t.width, t.height, std::uint32_t(vt_level_count(t.width, t.height))};
+    std::error_code error;
+    std::filesystem::create_directories(path.parent_path(), error);
+    std::filesystem::path temporary = path;
+    temporary += ".tmp";
+    {
+        std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+        file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+        // grey and grey-alpha are expanded, as the atlas is RGBA
+        std::vector<unsigned char> slot(std::size_t(vt_slot_size) * vt_slot_size * 4);
+        for (std::uint32_t level = 0; level < header.levels; level++) {
+            int width = t.level_width(level), height = t.level_height(level);
+            for (std::size_t ty = 0; ty < header.tiles_y(level); ty++) {
+                for (std::size_t tx = 0; tx < header.tiles_x(level); tx++) {
+                    for (int y = 0; y < vt_slot_size; y++) {
+                        for (int x = 0; x < vt_slot_size; x++) {
+                            int sx = (int(tx) * vt_tile_size + x - vt_tile_border + width) % width;
+                            int sy = (int(ty) * vt_tile_size + y - vt_tile_border + height) % height;
+                            const unsigned char *texel = t.levels[level].data() + (std::size_t(sy) * width + sx) * t.channels;
+                            unsigned char *out = slot.data() + (std::size_t(y) * vt_slot_size + x) * 4;
+                            bool grey = t.channels < 3;
+                            out[0] = texel[0];
+                            out[1] = grey ? texel[0] : texel[1];
+                            out[2] = grey ? texel[0] : texel[2];
+                            out[3] = t.channels == 4 ? texel[3] : (t.channels == 2 ? texel[1] : 255);
+                        }
+                    }
+                    auto block = compress_level(slot, vt_slot_size, vt_slot_size, 4, TEXTURE_BC3);
+                    file.write(reinterpret_cast<const char *>(block.data()), block.size());
+                }
+            }
+        }
+        if (!file)
+            throw std::runtime_error("Virtual texture baking failed: " + filename);
+    }
+    std::filesystem::rename(temporary, path, error);
+    return path;
+}
+
+// Page table and LRU tile cache over a square atlas of slots_per_side^2 slots.
+class VirtualTextureCache {
+public:
+    struct virtual_texture {
+        int width, height, levels;
+        // per level, row-major per tile: slot x, slot y, level, 255 as little-endian RGBA8; 0 if nothing is resident
+        std::vector<std::vector<std::uint32_t>> page_table;
+        bool dirty = true;
+
+        int tiles_x(int level) const {
+            return (width >> level) / vt_tile_size;
+        }
+
+        int tiles_y(int level) const {
+            return (height >> level) / vt_tile_size;
+        }
+    };
+
+private:
+    struct resident_tile {
+        int slot;
+        std::list<std::uint32_t>::iterator lru;
+        std::uint64_t last_used;
+    };
+
+    int slots_per_side;
+    std::vector<virtual_texture> textures;
+    // most recently used first
+    std::list<std::uint32_t> lru;
+    std::unordered_map<std::uint32_t, resident_tile> resident;
+    std::set<std::uint32_t> loading;
+    std::vector<int> free_slots;
+    std::uint64_t frame = 0;
+
+    void rebuild(std::uint32_t id) {
+        virtual_texture &vt = textures[id - 1];
+        for (int level = vt.levels - 1; level >= 0; level--) {
+            for (int y = 0; y < vt.tiles_y(level); y++) {
+                for (int x = 0; x < vt.tiles_x(level); x++) {
+                    std::uint32_t &entry = vt.page_table[level][y * vt.tiles_x(level) + x];
+                    auto it = resident.find(vt_pack({id, std::uint32_t(level), std::uint32_t(x), std::uint32_t(y)}));
+                    if (it != resident.end()) {
+                        std::uint32_t slot_x = it->second.slot % slots_per_side, slot_y = it->second.slot / slots_per_side;
+                        entry = slot_x | slot_y << 8 | std::uint32_t(level) << 16 | 255u << 24;
+                    } else if (level + 1 < vt.levels) {
+                        entry = vt.page_table[level + 1][(y / 2) * vt.tiles_x(level + 1) + x / 2];
+                    } else {
+                        entry = 0;
+                    }
+                }
+            }
+        }
+        vt.dirty = true;
+    }
+
+public:
+    std::size_t hits = 0, misses = 0, evictions = 0;
+
+    explicit VirtualTextureCache(int slots_per_side): slots_per_side(slots_per_side) {
+        for (int slot = slots_per_side * slots_per_side - 1; slot >= 0; slot--)
+            free_slots.push_back(slot);
+    }
+
+    // Returns the id of the new virtual texture, 0 if its size is not a whole number of tiles.
+    std::uint32_t add(int width, int height) {
+        int levels = vt_level_count(width, height);
+        if (levels == 0 || textures.size() >= 4095)
+            return 0;
+        virtual_texture vt = {width, height, levels, {}};
+        for (int level = 0; level < levels; level++)
+            vt.page_table.emplace_back(std::size_t(vt.tiles_x(level)) * vt.tiles_y(level), 0);
+        textures.push_back(std::move(vt));
+        return std::uint32_t(textures.size());
+    }
+
+    virtual_texture &get(std::uint32_t id) {
+        return textures[id - 1];
+    }
+
+    std::size_t texture_count() const {
+        return textures.size();
+    }
+
+    // Takes one frame of feedback. Requested tiles and their ancestors count as used; returns the ones that are
+    // neither resident nor loading, coarsest first so that every region gets some detail soon, at most max_tiles.
+    std::vector<std::uint32_t> request(const std::uint32_t *feedback, std::size_t count, std::size_t max_tiles) {
+        frame++;
+        std::set<std::uint32_t> requested;
+        for (std::size_t i = 0; i < count; i++) {
+            if (feedback[i] == 0)
+                continue;
+            vt_tile tile = vt_unpack(feedback[i]);
+            if (tile.texture == 0 || tile.texture > textures.size())
+                continue;
+            virtual_texture const &vt = textures[tile.texture - 1];
+            if (int(tile.level) >= vt.levels || int(tile.x) >= vt.tiles_x(tile.level)
+                || int(tile.y) >= vt.tiles_y(tile.level))
+                continue;
+            for (; int(tile.level) < vt.levels; tile.level++, tile.x /= 2, tile.y /= 2) {
+                if (!requested.insert(vt_pack(tile)).second)
+                    break;
+            }
+        }
+
+        std::vector<std::uint32_t> missing;
+        for (std::uint32_t key: requested) {
+            auto it = resident.find(key);
+            if (it != resident.end()) {
+                lru.splice(lru.begin(), lru, it->second.lru);
+                it->second.last_used = frame;
+                hits++;
+            } else if (!loading.contains(key)) {
+                missing.push_back(key);
+            }
+        }
+        std::stable_sort(missing.begin(), missing.end(), [](std::uint32_t a, std::uint32_t b) {
+            return vt_unpack(a).level > vt_unpack(b).level;
+        });
+        if (missing.size() > max_tiles)
+            missing.resize(max_tiles);
+        misses += missing.size();
+        loading.insert(missing.begin(), missing.end());
+        return missing;
+    }
+
+    // Places a loaded tile, evicting the least recently used one unless that was requested this frame as well.
+    // Returns the slot, or -1 if the tile has to be dropped.
+    int insert(std::uint32_t key) {
+        loading.erase(key);
+        int slot;
+        if (!free_slots.empty()) {
+            slot = free_slots.back();
+            free_slots.pop_back();
+        } else {
+            std::uint32_t victim = lru.back();
+            if (resident.at(victim).last_used >= frame)
+                return -1;
+            slot = resident.at(victim).slot;
+            resident.erase(victim);
+            lru.pop_back();
+            evictions++;
+            rebuild(vt_unpack(victim).texture);
+        }
+
+        lru.push_front(key);
+        resident[key] = {slot, lru.begin(), frame};
+        rebuild(vt_unpack(key).texture);
+        return slot;
+    }
+
+    // for a tile that failed to load
+    void cancel(std::uint32_t key) {
+        loading.erase(key);
+    }
+
+    std::size_t resident_count() const {
+        return resident.size();
+    }
+
+    int slot_count() const {
+        return slots_per_side * slots_per_side;
+    }
+};
+
+
+#endif
@@ -0,0 +1,265 @@
+#ifndef SPONZA_SCENE_VIRTUALTEXTURESYSTEM_H
+#define SPONZA_SCENE_VIRTUALTEXTURESYSTEM_H
+
+#include <GL/glew.h>
+#include <chrono>
+#include <deque>
+#include <future>
+#include <map>
+#include <ostream>
+#include "Program.h"
+#include "VirtualTexture.h"
+
+
+// GL half of virtual texturing. The feedback pass renders the tile ids the scene needs at 1/feedback_divisor of
+// the window resolution; the texels are read back through a pixel pack buffer and handed to VirtualTextureCache
+// one frame later. Missing tiles are read from the tiled files on worker threads and copied into a BC3 atlas, the
+// page tables are mirrored into one RGBA8 texture with a mip level per tile level for every virtual texture.
+class VirtualTextureSystem {
+private:
+    struct entry {
+        GLuint page_table;
+        // the tiled file, ready once baked
+        std::shared_future<std::filesystem::path> file;
+    };
+
+    struct tile_read {
+        std::uint32_t key;
+        std::future<std::vector<unsigned char>> data;
+    };
+
+    static const int slots_per_side = 16;
+    static const int atlas_size = slots_per_side * vt_slot_size;
+    static const int feedback_divisor = 8;
+    // tiles requested per frame
+    static const std::size_t max_requests = 16;
+
+    VirtualTextureCache cache;
+    std::map<std::string, std::uint32_t> ids;
+    std::vector<entry> entries;
+    std::deque<tile_read> reads;
+
+    GLuint atlas;
+    GLuint feedback_framebuffer = 0, feedback_color = 0, feedback_depth = 0;
+    GLuint feedback_buffers[2];
+    int feedback_width = 0, feedback_height = 0;
+    // size of the read back pending in each buffer, 0 if none
+    std::size_t feedback_pending[2] = {0, 0};
+    int current = 0;
+    GLfloat clear_color[4];
+
+    void resize_feedback(int width, int height) {
+        if (width == feedback_width && height == feedback_height)
+            return;
+        feedback_width = width;
+        feedback_height = height;
+
+        glBindTexture(GL_TEXTURE_2D, feedback_color);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+        glBindRenderbuffer(GL_RENDERBUFFER, feedback_depth);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+        for (GLuint buffer: feedback_buffers) {
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, buffer);
+            glBufferData(GL_PIXEL_PACK_BUFFER, std::size_t(width) * height * 4, nullptr, GL_STREAM_READ);
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        feedback_pending[0] = feedback_pending[1] = 0;
+    }
+
+    void upload_page_tables() {
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        for (std::uint32_t id = 1; id <= entries.size(); id++) {
+            auto &vt = cache.get(id);
+            if (!vt.dirty)
+                continue;
+            glBindTexture(GL_TEXTURE_2D, entries[id - 1].page_table);
+            for (int level = 0; level < vt.levels; level++)
+                glTexSubImage2D(GL_TEXTURE_2D, level, 0, 0, vt.tiles_x(level), vt.tiles_y(level), GL_RGBA,
+                                GL_UNSIGNED_BYTE, vt.page_table[level].data());
+            vt.dirty = false;
+        }
+    }
+
+    void read_tiles(std::vector<std::uint32_t> const &missing) {
+        for (std::uint32_t key: missing) {
+            auto file = entries[vt_unpack(key).texture - 1].file;
+            if (file.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+                cache.cancel(key);
+                continue;
+            }
+            reads.push_back({key, std::async(std::launch::async, [file, key] {
+                std::ifstream input(file.get(), std::ios::binary);
+                vt_file_header header;
+                if (!input.read(reinterpret_cast<char *>(&header), sizeof(header)) || header.magic != vt_file_magic)
+                    throw std::runtime_error("Virtual texture file is damaged");
+                std::vector<unsigned char> data(vt_tile_bytes);
+                input.seekg(header.offset(vt_unpack(key)));
+                if (!input.read(reinterpret_cast<char *>(data.data()), data.size()))
+                    throw std::runtime_error("Virtual texture file is truncated");
+                return data;
+            })});
+        }
+    }
+
+public:
+    std::size_t tiles_streamed = 0;
+
+    VirtualTextureSystem(): cache(slots_per_side) {
+        glGenTextures(1, &atlas);
+        glBindTexture(GL_TEXTURE_2D, atlas);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+        std::vector<unsigned char> empty(std::size_t(atlas_size / 4) * (atlas_size / 4) * 16, 0);
+        glCompressedTexImage2D(GL_TEXTURE_2D, 0, GL_COMPRESSED_RGBA_S3TC_DXT5_EXT, atlas_size, atlas_size, 0,
+                               GLsizei(empty.size()), empty.data());
+
+        glGenTextures(1, &feedback_color);
+        glBindTexture(GL_TEXTURE_2D, feedback_color);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glGenRenderbuffers(1, &feedback_depth);
+        glGenBuffers(2, feedback_buffers);
+        resize_feedback(1, 1);
+
+        glGenFramebuffers(1, &feedback_framebuffer);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, feedback_framebuffer);
+        glFramebufferTexture2D(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, feedback_color, 0);
+        glFramebufferRenderbuffer(GL_DRAW_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, feedback_depth);
+        if (glCheckFramebufferStatus(GL_DRAW_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            throw std::runtime_error("Virtual texture feedback framebuffer is incomplete");
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+    }
+
+    // Returns the id for the texture, 0 if it can't be virtual. The tiled file is baked on a worker thread if the
+    // asset cache doesn't have it yet; until then the texture samples as before.
+    std::uint32_t add(texture const &source) {
+        if (auto it = ids.find(source.path); it != ids.end())
+            return it->second;
+
+        std::uint32_t id = cache.add(source.width, source.height);
+        ids[source.path] = id;
+        if (id == 0)
+            return 0;
+
+        auto &vt = cache.get(id);
+        GLuint page_table;
+        glGenTextures(1, &page_table);
+        glBindTexture(GL_TEXTURE_2D, page_table);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, vt.levels - 1);
+        for (int level = 0; level < vt.levels; level++)
+            glTexImage2D(GL_TEXTURE_2D, level, GL_RGBA8, vt.tiles_x(level), vt.tiles_y(level), 0, GL_RGBA,
+                         GL_UNSIGNED_BYTE, vt.page_table[level].data());
+        vt.dirty = false;
+
+        std::string filename = source.path;
+        bool srgb = source.srgb;
+        entries.push_back({page_table, std::async(std::launch::async, [filename, srgb] {
+            return bake_virtual_texture(filename, srgb);
+        }).share()});
+        return id;
+    }
+
+    // Binds the feedback target; render the scene with FeedbackProgram, then call end_feedback().
+    void begin_feedback(int width, int height) {
+        resize_feedback(std::max(1, width / feedback_divisor), std::max(1, height / feedback_divisor));
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, feedback_framebuffer);
+        glViewport(0, 0, feedback_width, feedback_height);
+        glGetFloatv(GL_COLOR_CLEAR_VALUE, clear_color);
+        glClearColor(0.f, 0.f, 0.f, 0.f);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        // blending would mix the packed ids
+        glDisable(GL_BLEND);
+    }
+
+    void end_feedback() {
+        glEnable(GL_BLEND);
+        glClearColor(clear_color[0], clear_color[1], clear_color[2], clear_color[3]);
+        std::size_t size = std::size_t(feedback_width) * feedback_height * 4;
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, feedback_framebuffer);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, feedback_buffers[current]);
+        glReadPixels(0, 0, feedback_width, feedback_height, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+        feedback_pending[current] = size;
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+
+        // the other buffer was filled a frame ago, so mapping it doesn't stall
+        current = 1 - current;
+        if (feedback_pending[current] != 0) {
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, feedback_buffers[current]);
+            auto texels = static_cast<const std::uint32_t *>(
+                    glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, feedback_pending[current], GL_MAP_READ_BIT));
+            if (texels != nullptr) {
+                read_tiles(cache.request(texels, feedback_pending[current] / 4, max_requests));
+                glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+            }
+            feedback_pending[current] = 0;
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    }
+
+    // Call once per frame: copies finished tile reads into the atlas and refreshes the page tables.
+    void update() {
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        while (!reads.empty() && reads.front().data.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+            tile_read &read = reads.front();
+            std::vector<unsigned char> data;
+            try {
+                data = read.data.get();
+            } catch (std::exception const &) {
+                cache.cancel(read.key);
+                reads.pop_front();
+                continue;
+            }
+            int slot = cache.insert(read.key);
+            if (slot >= 0) {
+                glBindTexture(GL_TEXTURE_2D, atlas);
+                glCompressedTexSubImage2D(GL_TEXTURE_2D, 0, (slot % slots_per_side) * vt_slot_size,
+                                          (slot / slots_per_side) * vt_slot_size, vt_slot_size, vt_slot_size,
+                                          GL_COMPRESSED_RGBA_S3TC_DXT5_EXT, GLsizei(data.size()), data.data());
+                tiles_streamed++;
+            }
+            reads.pop_front();
+        }
+        upload_page_tables();
+
+        glActiveTexture(GL_TEXTURE0 + 7);
+        glBindTexture(GL_TEXTURE_2D, atlas);
+    }
+
+    // Selects the page table of the object's albedo for the next draw with v.
+    void bind(ProgramVariant const &v, std::uint32_t id) {
+        glUniform1i(v.vt_texture_location, GLint(id));
+        if (id == 0)
+            return;
+        auto &vt = cache.get(id);
+        glUniform2f(v.vt_size_location, float(vt.width), float(vt.height));
+        glUniform1i(v.vt_levels_location, vt.levels);
+        glUniform1f(v.vt_atlas_size_location, float(atlas_size));
+        glActiveTexture(GL_TEXTURE0 + 6);
+        glBindTexture(GL_TEXTURE_2D, entries[id - 1].page_table);
+    }
+
+    void bind_feedback(FeedbackProgram const &p, std::uint32_t id) {
+        glUniform1i(p.vt_texture_location, GLint(id));
+        if (id == 0)
+            return;
+        auto &vt = cache.get(id);
+        glUniform2f(p.vt_size_location, float(vt.width), float(vt.height));
+        glUniform1i(p.vt_levels_location, vt.levels);
+    }
+
+    static float feedback_lod_bias() {
+        return std::log2(float(feedback_divisor));
+    }
+
+    void dump(std::ostream &out) const {
+        out << "Virtual textures: " << cache.texture_count() << ", " << cache.resident_count() << "/"
+            << cache.slot_count() << " tiles resident, " << tiles_streamed << " streamed, " << cache.hits
+            << " hits, " << cache.misses << " misses, " << cache.evictions << " evictions" << std::endl;
+    }
+};
+
+
+#endif
@@ -0,0 +1,590 @@
+#include <GL/glew.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <optional>
+#include <random>
+#include <stdexcept>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <Object.h>
+#include <ModelLoader.h>
+#include <Parser.h>
+#include <VirtualTexture.h>
+#ifndef WIN32
+#include <sys/resource.h>
+#endif
+
+const char * encoding_name(TextureEncoding encoding)
+{
+	switch (encoding)
+	{
+	case TEXTURE_BC1: return "BC1";
+	case TEXTURE_BC3: return "BC3";
+	case TEXTURE_BC4: return "BC4";
+	case TEXTURE_BC5: return "BC5";
+	default: return "raw";
+	}
+}
+
+// Checks the format TextureRegistry::format_of gives every texture, with sRGB sampling off and on, and the size of
+// every level against what its channel count and encoding call for. Prints each mismatch and returns how many there
+// are.
+std::size_t check_texture_formats(std::map<std::string, texture> const &textures)
+{
+	static const GLenum formats[4] = {GL_RED, GL_RG, GL_RGB, GL_RGBA};
+	static const GLint swizzles[4][4] = {
+		{GL_RED, GL_RED, GL_RED, GL_ONE},
+		{GL_RED, GL_RED, GL_RED, GL_GREEN},
+		{GL_RED, GL_GREEN, GL_BLUE, GL_ALPHA},
+		{GL_RED, GL_GREEN, GL_BLUE, GL_ALPHA}};
+	// linear and sRGB internal format of raw textures
+	static const GLint raw_formats[4][2] = {
+		{GL_R8, GL_R8}, {GL_RG8, GL_RG8}, {GL_RGB8, GL_SRGB8}, {GL_RGBA8, GL_SRGB8_ALPHA8}};
+
+	std::size_t mismatches = 0;
+	auto mismatch = [&](texture const &t, std::string const &what)
+	{
+		std::cerr << "  " << t.path << " (" << t.channels << " channels, " << encoding_name(t.encoding) << "): "
+			<< what << std::endl;
+		mismatches++;
+	};
+	auto hex = [](GLint value)
+	{
+		std::ostringstream text;
+		text << "0x" << std::hex << value;
+		return text.str();
+	};
+	bool srgb_sampling = TextureRegistry::srgb_sampling;
+	for (auto const &[path, t] : textures)
+	{
+		if (t.channels < 1 || t.channels > 4)
+		{
+			mismatch(t, "unsupported channel count");
+			continue;
+		}
+		int c = t.channels - 1;
+		// what block_encoding picks; normal maps are BC5 whatever their channel count
+		TextureEncoding block = c == 0 ? TEXTURE_BC4 : c == 1 ? TEXTURE_BC5 : c == 2 ? TEXTURE_BC1 : TEXTURE_BC3;
+		if (compress_textures ? t.encoding != block && t.encoding != TEXTURE_BC5 : t.encoding != TEXTURE_RAW)
+			mismatch(t, "unexpected encoding");
+
+		for (bool sampling : {false, true})
+		{
+			TextureRegistry::srgb_sampling = sampling;
+			bool srgb = t.srgb && sampling;
+			GLint internal_format = raw_formats[c][srgb];
+			switch (t.encoding)
+			{
+			case TEXTURE_BC1:
+				internal_format = srgb ? GL_COMPRESSED_SRGB_S3TC_DXT1_EXT : GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+				break;
+			case TEXTURE_BC3:
+				internal_format = srgb ? GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT : GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+				break;
+			case TEXTURE_BC4:
+				internal_format = GL_COMPRESSED_RED_RGTC1;
+				break;
+			case TEXTURE_BC5:
+				internal_format = GL_COMPRESSED_RG_RGTC2;
+				break;
+			default:
+				break;
+			}
+
+			auto f = TextureRegistry::format_of(t);
+			std::string when = std::string("with sRGB sampling ") + (sampling ? "on" : "off") + ": ";
+			if (f.internal_format != internal_format)
+				mismatch(t, when + "internal format " + hex(f.internal_format) + " instead of " + hex(internal_format));
+			if (f.format != formats[c])
+				mismatch(t, when + "pixel format " + hex(f.format) + " instead of " + hex(formats[c]));
+			if (!std::equal(f.swizzle, f.swizzle + 4, swizzles[c]))
+				mismatch(t, when + "swizzle differs");
+		}
+
+		std::size_t level_count = 1;
+		for (int width = t.width, height = t.height; width > 1 || height > 1; level_count++)
+		{
+			width = std::max(1, width / 2);
+			height = std::max(1, height / 2);
+		}
+		if (t.levels.size() != level_count)
+			mismatch(t, std::to_string(t.levels.size()) + " levels instead of " + std::to_string(level_count));
+		for (std::size_t level = 0; level < std::min(level_count, t.levels.size()); level++)
+		{
+			std::size_t width = std::max(1, t.width >> level), height = std::max(1, t.height >> level);
+			std::size_t bytes = width * height * t.channels;
+			if (t.encoding != TEXTURE_RAW)
+				bytes = (width + 3) / 4 * ((height + 3) / 4)
+					* (t.encoding == TEXTURE_BC1 || t.encoding == TEXTURE_BC4 ? 8 : 16);
+			if (t.levels[level].size() != bytes)
+				mismatch(t, "level " + std::to_string(level) + " has " + std::to_string(t.levels[level].size())
+					+ " bytes instead of " + std::to_string(bytes));
+		}
+	}
+	TextureRegistry::srgb_sampling = srgb_sampling;
+	return mismatches;
+}
+
+// Bakes the tiled files of the color textures and runs the virtual texture cache on a simulated feedback buffer:
+// a window of finest tiles sweeps over every texture while the rest of it is requested two levels coarser. Tiles
+// are read back from the files, and every page table entry is checked against the resident tiles.
+void simulate_virtual_textures(std::map<std::string, texture> const &textures)
+{
+	// smaller than the viewer's atlas, so that the simulation has to evict
+	VirtualTextureCache cache(8);
+	std::vector<std::pair<std::uint32_t, vt_file_header>> virtual_textures;
+	std::map<std::uint32_t, std::filesystem::path> files;
+	for (auto const &[path, t] : textures)
+	{
+		if (!t.srgb)
+			continue;
+		std::uint32_t id = cache.add(t.width, t.height);
+		if (id == 0)
+			continue;
+		files[id] = bake_virtual_texture(t.path, t.srgb);
+		std::ifstream file(files[id], std::ios::binary);
+		vt_file_header header;
+		file.read(reinterpret_cast<char *>(&header), sizeof(header));
+		virtual_textures.emplace_back(id, header);
+	}
+
+	std::map<std::uint32_t, std::uint32_t> slots;
+	std::vector<unsigned char> tile(vt_tile_bytes);
+	for (int frame = 0; frame < 64; frame++)
+	{
+		std::vector<std::uint32_t> feedback;
+		for (auto const &[id, header] : virtual_textures)
+		{
+			std::uint32_t coarse = std::min<std::uint32_t>(2, header.levels - 1);
+			for (std::uint32_t y = 0; y < header.tiles_y(0); y++)
+			{
+				for (std::uint32_t x = 0; x < header.tiles_x(0); x++)
+				{
+					bool near = (x + y + frame) % 8 < 2;
+					std::uint32_t level = near ? 0 : coarse;
+					feedback.push_back(vt_pack({id, level, x >> level, y >> level}));
+				}
+			}
+		}
+
+		for (std::uint32_t key : cache.request(feedback.data(), feedback.size(), 32))
+		{
+			std::ifstream file(files[vt_unpack(key).texture], std::ios::binary);
+			vt_file_header header;
+			file.read(reinterpret_cast<char *>(&header), sizeof(header));
+			file.seekg(header.offset(vt_unpack(key)));
+			if (!file.read(reinterpret_cast<char *>(tile.data()), tile.size()))
+				throw std::runtime_error("Virtual texture tile is missing");
+			cache.insert(key);
+		}
+	}
+
+	for (auto const &[id, header] : virtual_textures)
+	{
+		auto const &vt = cache.get(id);
+		for (int level = 0; level < vt.levels; level++)
+		{
+			for (std::uint32_t entry : vt.page_table[level])
+			{
+				if (entry == 0)
+					continue;
+				std::uint32_t resident_level = (entry >> 16) & 255;
+				if (resident_level < std::uint32_t(level) || resident_level >= std::uint32_t(vt.levels))
+					throw std::runtime_error("Virtual texture page table points at a finer level");
+			}
+		}
+	}
+	std::cout << "Virtual textures: " << virtual_textures.size() << ", " << cache.resident_count() << "/"
+		<< cache.slot_count() << " tiles resident, " << cache.hits << " hits, " << cache.misses << " misses, "
+		<< cache.evictions << " evictions" << std::endl;
+}
+
+// Builds the tangents and levels of detail of the .obj next to the .mtl, as the viewer loads it at scale_factor, if
+// there is one.
+void bake_lods(std::string const &mtl_path, std::map<std::string, mtl_object> &materials, float scale_factor)
+{
+	std::string obj_path = mtl_path.substr(0, mtl_path.rfind('.')) + ".obj";
+	std::ifstream obj_file(PRACTICE_SOURCE_DIRECTORY + obj_path);
+	if (!obj_file)
+		return;
+	auto objects = Parser::load_obj(obj_file, materials, scale_factor, PRACTICE_SOURCE_DIRECTORY + obj_path);
+	Parser::build_lods(objects, PRACTICE_SOURCE_DIRECTORY + obj_path, scale_factor);
+}
+
+// Loads the objects of a model in file order and measures what the vertex cache and overdraw optimizations of the
+// viewer's load pipeline, and the meshlets built after them, do to each of them; --overdraw. Alpha blended objects keep their order, as they do there.
+void measure_overdraw(std::string const &mtl_path, std::map<std::string, mtl_object> &materials)
+{
+	std::string obj_path = mtl_path.substr(0, mtl_path.rfind('.')) + ".obj";
+	std::ifstream obj_file(PRACTICE_SOURCE_DIRECTORY + obj_path);
+	if (!obj_file)
+		throw std::runtime_error("Cannot open " + obj_path);
+	optimize_meshes = false;
+	auto objects = Parser::load_obj(obj_file, materials);
+	optimize_meshes = true;
+
+	overdraw_statistics total_before, total_after, total_clustered;
+	for (Object &object : objects)
+	{
+		if (object.indices.empty() || Parser::is_transparent(object.mtl))
+			continue;
+		optimize_vertex_cache(object.indices, object.vertices.size());
+		auto cache_before = analyze_vertex_cache(object.indices, object.vertices.size());
+		auto before = analyze_overdraw(object.vertices, object.indices);
+		optimize_overdraw(object.indices, object.vertices);
+		auto cache_after = analyze_vertex_cache(object.indices, object.vertices.size());
+		auto after = analyze_overdraw(object.vertices, object.indices);
+		Parser::cluster_object(object);
+		auto cache_clustered = analyze_vertex_cache(object.indices, object.vertices.size());
+		auto clustered = analyze_overdraw(object.vertices, object.indices);
+
+		for (auto [total, statistics] : {std::pair{&total_before, before}, std::pair{&total_after, after},
+			std::pair{&total_clustered, clustered}})
+		{
+			total->covered += statistics.covered;
+			total->shaded += statistics.shaded;
+		}
+		std::cout << "  " << object.mtl.name << ": overdraw " << before.overdraw() << " -> " << after.overdraw()
+			<< " -> " << clustered.overdraw() << " in meshlets, ACMR " << cache_before.acmr << " -> "
+			<< cache_after.acmr << " -> " << cache_clustered.acmr << std::endl;
+	}
+	std::cout << obj_path << ": overdraw " << total_before.overdraw() << " -> " << total_after.overdraw() << " -> "
+		<< total_clustered.overdraw() << " in meshlets, from six directions" << std::endl;
+}
+
+// Times Parser::parse_face_vertex alone and load_obj as a whole on a generated grid of about face_count quads that
+// cycles through every face vertex form, negative indices included; --parse-benchmark.
+void benchmark_obj_parsing(std::size_t face_count)
+{
+	std::size_t side = std::max<std::size_t>(2, std::size_t(std::sqrt(double(face_count))) + 1);
+	std::ostringstream obj;
+	for (std::size_t y = 0; y < side; y++)
+		for (std::size_t x = 0; x < side; x++)
+			obj << "v " << x << " 0 " << y << "\nvt " << float(x) / side << " " << float(y) / side << "\nvn 0 1 0\n";
+	std::size_t count = side * side, faces = 0;
+	for (std::size_t y = 0; y + 1 < side; y++)
+	{
+		for (std::size_t x = 0; x + 1 < side; x++, faces++)
+		{
+			std::size_t corners[4] = {y * side + x + 1, (y + 1) * side + x + 1, (y + 1) * side + x + 2, y * side + x + 2};
+			obj << "f";
+			for (std::size_t corner : corners)
+			{
+				long long index = faces % 5 == 4 ? (long long)corner - (long long)count - 1 : (long long)corner;
+				switch (faces % 5)
+				{
+				case 0: obj << " " << index; break;
+				case 1: obj << " " << index << "/" << index; break;
+				case 2: obj << " " << index << "//" << index; break;
+				default: obj << " " << index << "/" << index << "/" << index; break;
+				}
+			}
+			obj << "\n";
+		}
+	}
+	std::string text = obj.str();
+
+	auto start = std::chrono::high_resolution_clock::now();
+	std::size_t counts[3] = {count, count, count}, corners = 0;
+	std::uint32_t indices[3];
+	std::string_view rest(text);
+	while (!rest.empty())
+	{
+		std::string_view line = rest.substr(0, rest.find('\n'));
+		rest.remove_prefix(std::min(rest.size(), line.size() + 1));
+		if (line[0] != 'f')
+			continue;
+		line.remove_prefix(2);
+		while (Parser::parse_face_vertex(line, counts, indices))
+			corners++;
+	}
+	float parse_ms = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+
+	std::istringstream input(text);
+	std::map<std::string, mtl_object> materials;
+	optimize_meshes = false;
+	start = std::chrono::high_resolution_clock::now();
+	auto objects = Parser::load_obj(input, materials, 1);
+	float load_ms = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+	optimize_meshes = true;
+
+	std::cout << faces << " faces, " << text.size() / (1 << 20) << " MB: face vertices parsed in " << parse_ms << " ms ("
+		<< faces / parse_ms / 1000.f << " M faces/s, " << corners << " corners), load_obj in " << load_ms << " ms ("
+		<< text.size() / load_ms / 1000.f << " MB/s)" << std::endl;
+}
+
+// Feeds iterations randomly mutated face lines through Parser::parse_face and checks that each one either throws
+// std::runtime_error or gives only indices in range: v always, vt and vn unless missing. Mutations insert, replace and
+// delete characters, mostly digits, signs and separators, and splice in numbers at the edges of the integer types.
+// Returns the number of lines that broke that; --fuzz.
+std::size_t fuzz_face_parser(std::size_t iterations)
+{
+	const std::size_t counts[3] = {10, 5, 3};
+	const char *seeds[] = {"1 2 3", "1/1 2/2 3/3", "1//1 2//2 3//3", "1/1/1 2/2/2 3/3/3 4/4/3", "-1/-1/-1 -2/-2/-2 -3/-3/-3",
+		"+1 +2/+1 +3//+2"};
+	const char *numbers[] = {"0", "-0", "10", "11", "-10", "-11", "2147483647", "-2147483648", "4294967295",
+		"4294967296", "-4294967296", "9223372036854775807", "-9223372036854775808", "9223372036854775808",
+		"18446744073709551616", "+-3", "-+3", "++3", "--3"};
+	const std::string alphabet = "0123456789/-+ \t\r";
+
+	std::mt19937 random(12345);
+	auto pick = [&](std::size_t size) {
+		return std::size_t(random() % size);
+	};
+	std::size_t accepted = 0, rejected = 0, broken = 0;
+	for (std::size_t iteration = 0; iteration < iterations; iteration++)
+	{
+		std::string line = seeds[pick(std::size(seeds))];
+		for (std::size_t mutation = 0, mutations = 1 + pick(4); mutation < mutations; mutation++)
+		{
+			std::size_t at = pick(line.size() + 1);
+			switch (pick(4))
+			{
+			case 0: line.insert(at, 1, alphabet[pick(alphabet.size())]); break;
+			case 1: if (at < line.size()) line[at] = pick(8) == 0 ? char(random()) : alphabet[pick(alphabet.size())]; break;
+			case 2: if (at < line.size()) line.erase(at, 1 + pick(3)); break;
+			default: line.insert(at, numbers[pick(std::size(numbers))]); break;
+			}
+		}
+
+		bool in_range = true;
+		try
+		{
+			Parser::parse_face(line, counts, [&](std::uint32_t const *a, std::uint32_t const *b, std::uint32_t const *c)
+			{
+				for (std::uint32_t const *v : {a, b, c})
+				{
+					in_range = in_range && v[0] < counts[0];
+					for (int component = 1; component < 3; component++)
+						in_range = in_range && (v[component] < counts[component] || v[component] == Parser::missing_index);
+				}
+			});
+			accepted++;
+		}
+		catch (std::runtime_error const &)
+		{
+			rejected++;
+		}
+		if (!in_range)
+		{
+			broken++;
+			std::cout << "  indices out of range for \"" << line << "\"" << std::endl;
+		}
+	}
+	std::cout << iterations << " mutated face lines: " << accepted << " accepted, " << rejected << " rejected, "
+		<< broken << " out of range" << std::endl;
+	return broken;
+}
+
+// The most memory the process has had resident so far, in MB; 0 where that isn't known.
+float peak_memory_mb()
+{
+#ifdef WIN32
+	return 0.f;
+#else
+	rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+	return usage.ru_maxrss / float(1 << 20);
+#else
+	return usage.ru_maxrss / 1024.f;
+#endif
+#endif
+}
+
+// Writes a grid of about triangle_count triangles with texture coordinates and normals, in two materials, the first
+// normal-mapped, to a temporary OBJ and loads it through every stage of Parser::load_obj, packing the vertices too,
+// printing how much the peak memory of the process has grown after each stage next to the size of the objects;
+// --stream-benchmark.
+void benchmark_obj_streaming(std::size_t triangle_count)
+{
+	std::size_t side = std::max<std::size_t>(2, std::size_t(std::sqrt(double(triangle_count / 2))) + 1);
+	auto path = std::filesystem::temp_directory_path() / "sponza_stream_benchmark.obj";
+	{
+		std::ofstream obj(path);
+		for (std::size_t y = 0; y < side; y++)
+			for (std::size_t x = 0; x < side; x++)
+				obj << "v " << x << " 0 " << y << "\nvt " << float(x) / side << " " << float(y) / side << "\nvn 0 1 0\n";
+		for (std::size_t y = 0; y + 1 < side; y++)
+		{
+			if (y == 0 || y == side / 2)
+				obj << "usemtl " << (y == 0 ? "first" : "second") << "\n";
+			for (std::size_t x = 0; x + 1 < side; x++)
+			{
+				std::size_t corners[4] = {y * side + x + 1, (y + 1) * side + x + 1, (y + 1) * side + x + 2, y * side + x + 2};
+				obj << "f";
+				for (std::size_t corner : corners)
+					obj << " " << corner << "/" << corner << "/" << corner;
+				obj << "\n";
+			}
+		}
+		if (!obj)
+			throw std::runtime_error("Cannot write " + path.string());
+	}
+	std::size_t file_size = std::filesystem::file_size(path);
+
+	std::map<std::string, mtl_object> materials;
+	for (std::string name : {"first", "second"})
+	{
+		materials[name].clear();
+		materials[name].name = name;
+	}
+	materials["first"].norm = "normal.png";
+
+	std::ostringstream report;
+	report << std::fixed << std::setprecision(0);
+	float memory_before = peak_memory_mb();
+	auto start = std::chrono::high_resolution_clock::now();
+	auto stage = [&](const char *name, std::vector<Object> const &objects)
+	{
+		std::size_t object_bytes = 0;
+		for (Object const &object : objects)
+			object_bytes += object.vertices.capacity() * sizeof(vertex) + object.tangents.capacity() * sizeof(glm::vec4)
+				+ object.indices.capacity() * sizeof(std::uint32_t) + object.meshlets.capacity() * sizeof(meshlet)
+				+ object.packed_vertices.capacity() * sizeof(packed_vertex);
+		report << "  " << name << ": " << std::chrono::duration<float, std::milli>(
+				std::chrono::high_resolution_clock::now() - start).count() << " ms, objects "
+			<< object_bytes / float(1 << 20) << " MB, peak memory grew by " << peak_memory_mb() - memory_before << " MB\n";
+	};
+
+	// the stages of Parser::load_obj, without the cache
+	std::ifstream input(path);
+	auto objects = Parser::read_obj(input, materials, 1);
+	stage("read_obj", objects);
+	input.close();
+	std::filesystem::remove(path);
+	Parser::build_tangents(objects, {});
+	stage("build_tangents", objects);
+	if (optimize_meshes)
+	{
+		Parser::optimize_objects(objects);
+		stage("optimize_objects", objects);
+	}
+	Parser::split_objects(objects);
+	stage("split_objects", objects);
+	Parser::cluster_objects(objects);
+	stage("cluster_objects", objects);
+	Parser::pack_objects(objects);
+	stage("pack_objects", objects);
+
+	std::size_t triangles = 0;
+	for (Object const &object : objects)
+		triangles += object.indices.size() / 3;
+	std::cout << triangles << " triangles, " << file_size / (1 << 20) << " MB loaded by stage:\n" << report.str()
+		<< std::flush;
+}
+
+// Bakes the textures of the given models (paths relative to the source directory, Sponza and Shrek by default)
+// into the asset cache: mip chains plus block compression, one thread per texture, and the levels of detail of their
+// objects, at the scale the viewer loads them with (--scale sets it for the models after it). The viewer then only
+// reads them.
+// --raw bakes uncompressed textures, --list prints the channels, encoding and size of every texture, --virtual also
+// bakes the virtual texture tiles and simulates streaming them, --overdraw measures the overdraw of every object of
+// the .obj next to the .mtl before and after its triangles are reordered, --parse-benchmark only times the OBJ parser
+// on a generated 2M face file, --stream-benchmark measures the memory that loading a generated 10M triangle OBJ takes,
+// --fuzz checks the OBJ face parser on a million mutated face lines and fails if any gives an index out of range.
+// The GL format and level sizes of every baked texture are checked, and bake fails if any is wrong.
+int main(int argc, char **argv) try
+{
+	// model and the scale its objects are baked at
+	std::vector<std::pair<std::string, float>> models;
+	std::optional<float> scale_factor;
+	bool list = false, virtual_textures = false, overdraw = false, parse_benchmark = false, stream_benchmark = false,
+		fuzz = false;
+	for (int i = 1; i < argc; i++)
+	{
+		std::string argument = argv[i];
+		if (argument == "--raw")
+			compress_textures = false;
+		else if (argument == "--list")
+			list = true;
+		else if (argument == "--virtual")
+			virtual_textures = true;
+		else if (argument == "--overdraw")
+			overdraw = true;
+		else if (argument == "--parse-benchmark")
+			parse_benchmark = true;
+		else if (argument == "--stream-benchmark")
+			stream_benchmark = true;
+		else if (argument == "--fuzz")
+			fuzz = true;
+		else if (argument == "--scale" && i + 1 < argc)
+			scale_factor = std::stof(argv[++i]);
+		else
+		{
+			float model_scale = scale_factor.value_or(1500.f);
+			for (model_source const &model : {sponza_model, shrek_model})
+				if (argument == model.mtl_path && !scale_factor)
+					model_scale = model.scale_factor;
+			models.emplace_back(argument, model_scale);
+		}
+	}
+	if (parse_benchmark)
+	{
+		benchmark_obj_parsing(2000000);
+		return EXIT_SUCCESS;
+	}
+	if (fuzz)
+		return fuzz_face_parser(1000000) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+	if (stream_benchmark)
+	{
+		benchmark_obj_streaming(10000000);
+		return EXIT_SUCCESS;
+	}
+	if (models.empty())
+		models = {{sponza_model.mtl_path, sponza_model.scale_factor}, {shrek_model.mtl_path, shrek_model.scale_factor}};
+
+	std::size_t format_mismatches = 0;
+	for (auto const &[mtl_path, model_scale] : models)
+	{
+		auto start = std::chrono::high_resolution_clock::now();
+		std::ifstream mtl_file(PRACTICE_SOURCE_DIRECTORY + mtl_path);
+		if (!mtl_file)
+			throw std::runtime_error("Cannot open " + mtl_path);
+		auto materials = Parser::load_mtl(mtl_file);
+		auto textures = Parser::load_textures(materials);
+
+		std::size_t bytes = 0, raw_bytes = 0;
+		for (auto const &[path, t] : textures)
+		{
+			std::size_t texture_bytes = 0;
+			for (std::size_t level = 0; level < t.levels.size(); level++)
+			{
+				texture_bytes += t.levels[level].size();
+				raw_bytes += t.raw_level_size(level);
+			}
+			bytes += texture_bytes;
+			if (list)
+				std::cout << "  " << path << ": " << t.width << "x" << t.height << ", " << t.channels << " channels, "
+					<< encoding_name(t.encoding) << ", " << t.levels.size() << " levels, " << texture_bytes / 1024
+					<< " KB" << std::endl;
+		}
+		std::cout << mtl_path << ": " << textures.size() << " textures baked in "
+			<< std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count()
+			<< " ms, " << bytes / (1 << 20) << " MB instead of " << raw_bytes / (1 << 20) << " MB" << std::endl;
+		std::size_t mismatches = check_texture_formats(textures);
+		std::cout << mtl_path << ": formats of " << textures.size() << " textures checked, " << mismatches
+			<< " mismatches" << std::endl;
+		format_mismatches += mismatches;
+		bake_lods(mtl_path, materials, model_scale);
+		if (virtual_textures)
+			simulate_virtual_textures(textures);
+		if (overdraw)
+			measure_overdraw(mtl_path, materials);
+	}
+	return format_mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+catch (std::exception const & e)
+{
+	std::cerr << e.what() << std::endl;
+	return EXIT_FAILURE;
+}
@@ -13,11 +13,14 @@
 #include <chrono>
 #include <vector>
 #include <map>
+#include <optional>
 #include <cmath>
 #include <Object.h>
 #include <Renderer.h>
 #include <Program.h>
 #include <RenderSetuper.h>
+#include <ModelLoader.h>
+#include <PipelineStatistics.h>
 
 #define GLM_FORCE_SWIZZLE
 #define GLM_ENABLE_EXPERIMENTAL
@@ -40,6 +43,12 @@ void glew_fail(std::string_view message, GLenum error)
 
 int main() try
 {
+	auto process_start = std::chrono::high_resolution_clock::now();
+
+	// parsing and decoding runs on worker threads while the window and the GL context are created
+	ModelLoader sponza_loader(sponza_model.mtl_path, sponza_model.obj_path, sponza_model.scale_factor);
+	ModelLoader shrek_loader(shrek_model.mtl_path, shrek_model.obj_path, shrek_model.scale_factor);
+
 	if (SDL_Init(SDL_INIT_VIDEO) != 0)
 		sdl2_fail("SDL_Init: ");
 
@@ -80,18 +89,37 @@ int main() try
     glDepthFunc(GL_LEQUAL);
     glEnable(GL_CULL_FACE);
 
+    enable_parallel_shader_compile();
+
     Program p;
-    p.setup_textures();
-    p.setup_lights();
 
     ShadowProgram shadow_program;
+    DepthProgram depth_program(Object::pack_vertices ? std::uint32_t(SHADER_PACKED_VERTEX) : 0u);
+    FeedbackProgram feedback_program(Object::pack_vertices ? std::uint32_t(SHADER_PACKED_VERTEX) : 0u);
+
+    SceneRenderer scene_renderer(p, shadow_program);
+    ShrekRenderer shrek_renderer(p, shadow_program);
 
-    SceneRenderer scene_renderer(p, shadow_program, "/sponza/sponza.mtl", "/sponza/sponza.obj");
-    ShrekRenderer shrek_renderer(p, shadow_program, "/shrek/shrek.mtl", "/shrek/shrek.obj");
+    shadow_program.finish();
+    depth_program.finish();
+    feedback_program.finish();
 
-    scene_renderer.setup_shadows_settings();
+    TextureUploader texture_uploader;
+    // B halves the texture budget down to 8 MB, then restores it
+    const std::size_t texture_budget = std::size_t(256) << 20;
+    TextureRegistry texture_registry(texture_uploader, texture_budget);
 
-    RenderSetuper render_setuper(p, shadow_program);
+    // V switches the albedo maps to virtual textures once everything is loaded
+    std::optional<VirtualTextureSystem> virtual_textures;
+    bool virtual_texturing = false;
+
+    // the one count for the shadow map array, the cascade transforms and the shadow passes
+    const int shadow_cascade_count = std::min(4, max_shadow_cascades);
+    const int shadow_map_res = 1024;
+
+    scene_renderer.setup_shadows_settings(shadow_cascade_count, shadow_map_res);
+
+    RenderSetuper render_setuper(shadow_program, shadow_cascade_count, shadow_map_res);
     render_setuper.update_window_size(width, height);
 
 
@@ -114,6 +142,12 @@ int main() try
 	camera_params.camera_distance_z = 0.0f;
 	bool running = true;
 	bool paused = false;
+    bool loaded = false, first_frame = true;
+    // time slice per frame for GL uploads while the scene streams in
+    const auto upload_budget = std::chrono::milliseconds(8);
+    bool depth_prepass = false;
+    FragmentInvocationsQuery fragment_invocations_query;
+    ShadowCasterStats shadow_caster_stats;
 	while (running)
 	{
 		for (SDL_Event event; SDL_PollEvent(&event);) switch (event.type)
@@ -174,30 +208,164 @@ int main() try
         if (button_down[SDLK_q])
             running = false;
 
+        if (button_down[SDLK_z]) {
+            button_down[SDLK_z] = false;
+            // packed vertices decode their positions exactly like the quantized depth stream
+            if (Object::quantize_depth_stream && !Object::pack_vertices)
+                std::cout << "Depth pre-pass needs a float depth stream" << std::endl;
+            else
+                depth_prepass = !depth_prepass;
+            std::cout << "Depth pre-pass: " << (depth_prepass ? "on" : "off") << std::endl;
+        }
+
+        if (button_down[SDLK_p]) {
+            button_down[SDLK_p] = false;
+            std::cout << "Shadow casters: " << shadow_caster_stats.rendered << " rendered, "
+                      << shadow_caster_stats.culled << " culled, " << shadow_caster_stats.triangles
+                      << " triangles" << std::endl;
+            std::cout << "Meshlets: " << Object::meshlet_stats.tested << " tested, "
+                      << Object::meshlet_stats.back_facing << " back-facing, " << Object::meshlet_stats.outside
+                      << " outside the frustum, " << Object::meshlet_stats.triangles << " triangles submitted in all passes"
+                      << std::endl;
+            if (fragment_invocations_query.supported)
+                std::cout << "Fragment shader invocations in the opaque color pass: "
+                          << fragment_invocations_query.results[0] << " without depth pre-pass, "
+                          << fragment_invocations_query.results[1] << " with depth pre-pass" << std::endl;
+            texture_registry.dump(std::cout);
+            if (virtual_textures)
+                virtual_textures->dump(std::cout);
+        }
+
+        if (button_down[SDLK_v]) {
+            button_down[SDLK_v] = false;
+            if (!loaded) {
+                std::cout << "Virtual texturing is available once loading is done" << std::endl;
+            } else if (!GLEW_EXT_texture_compression_s3tc) {
+                std::cout << "Virtual texturing needs S3TC texture compression" << std::endl;
+            } else {
+                if (!virtual_textures)
+                    virtual_textures.emplace();
+                virtual_texturing = !virtual_texturing;
+                scene_renderer.set_virtual_textures(virtual_texturing ? &*virtual_textures : nullptr);
+                std::cout << "Virtual texturing: " << (virtual_texturing ? "on" : "off") << std::endl;
+            }
+        }
+
+        if (button_down[SDLK_b]) {
+            button_down[SDLK_b] = false;
+            texture_registry.budget /= 2;
+            if (texture_registry.budget < (std::size_t(8) << 20))
+                texture_registry.budget = texture_budget;
+            std::cout << "Texture budget: " << texture_registry.budget / (1 << 20) << " MB" << std::endl;
+        }
+        if (button_down[SDLK_m]) {
+            button_down[SDLK_m] = false;
+            Object::cull_meshlets = !Object::cull_meshlets;
+            std::cout << "Meshlet culling: " << (Object::cull_meshlets ? "on" : "off") << std::endl;
+        }
+        shadow_caster_stats = ShadowCasterStats();
+        Object::meshlet_stats = MeshletCullStats();
+
+        // textures keep streaming after loading, as the residency manager drops and restores levels
+        texture_uploader.process();
+        texture_registry.update();
+
+        if (!loaded) {
+            auto deadline = std::chrono::high_resolution_clock::now() + upload_budget;
+            bool scene_loaded = scene_renderer.load_step(sponza_loader, texture_registry, deadline);
+            bool shrek_loaded = shrek_renderer.load_step(shrek_loader, texture_registry, deadline);
+            loaded = scene_loaded && shrek_loaded && texture_uploader.idle();
+
+            std::size_t total = scene_renderer.object_count() + shrek_renderer.object_count();
+            std::size_t uploaded = scene_renderer.uploaded_object_count() + shrek_renderer.uploaded_object_count();
+            std::string title = "Loading: " + std::to_string(uploaded) + "/" + std::to_string(total) + " objects";
+            SDL_SetWindowTitle(window, loaded ? "Graphics course homework 2" : title.c_str());
+
+            if (loaded) {
+                p.finish();
+                std::cout << "Fully loaded in " << std::chrono::duration<float, std::milli>(
+                        std::chrono::high_resolution_clock::now() - process_start).count() << " ms" << std::endl;
+                std::cout << "Program variants: " << p.variant_count() << std::endl;
+                std::cout << "Texture uploads: " << texture_uploader.pbo_uploads << " streamed, "
+                          << texture_uploader.direct_uploads << " direct" << std::endl;
+                std::cout << "GL textures: " << texture_registry.texture_count() << " ("
+                          << texture_registry.bytes() / (1 << 20) << " MB) for " << texture_registry.references
+                          << " references (" << texture_registry.referenced_bytes / (1 << 20)
+                          << " MB if uploaded per reference)" << std::endl;
+                // texels are fetched block by block, so sampling bandwidth shrinks by the same ratio as memory
+                std::cout << "Block compression: " << texture_registry.bytes() / (1 << 20) << " MB instead of "
+                          << texture_registry.raw_bytes() / (1 << 20) << " MB uncompressed ("
+                          << float(texture_registry.raw_bytes()) / std::max<std::size_t>(1, texture_registry.bytes())
+                          << "x less memory and sampling bandwidth)" << std::endl;
+                std::cout << "Blocked on shader programs for " << program_cache_stats.build_ms << " ms (binary cache: "
+                          << program_cache_stats.hits << " hits, " << program_cache_stats.misses << " misses)" << std::endl;
+            }
+        }
+
 		glClearColor(0.8f, 0.8f, 0.9f, 0.f);
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
         shrek_renderer.change_time(time);
         scene_renderer.update_view(camera_params);
         scene_renderer.update_projection(width, height);
+        scene_renderer.update_shadow_cascades();
 
-        render_setuper.setup_shadow_render();
+        for (int cascade = 0; cascade < shadow_cascade_count; cascade++) {
+            render_setuper.setup_shadow_render(cascade);
+            scene_renderer.setup_shadow_cascade(cascade);
 
-        scene_renderer.render();
-        shrek_renderer.render();
+            scene_renderer.render_shadow(scene_renderer.get_shadow_transform(cascade), shadow_map_res, shadow_caster_stats);
+            shrek_renderer.render_shadow(scene_renderer.get_shadow_transform(cascade), shadow_map_res, shadow_caster_stats);
+        }
 
         render_setuper.setup_cubemap_render();
-        scene_renderer.render_cubemap(shrek_renderer.translate, render_setuper.cubemap_texture);
+        scene_renderer.render_cubemap(shrek_renderer.translate, render_setuper.cubemap_texture, render_setuper.cubemap_res);
+
+        if (virtual_texturing) {
+            virtual_textures->update();
+            virtual_textures->begin_feedback(width, height);
+            scene_renderer.render_feedback(feedback_program);
+            virtual_textures->end_feedback();
+        }
 
         render_setuper.setup_render();
 
+        if (depth_prepass) {
+            scene_renderer.setup_depth_prepass(depth_program);
+            glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+            scene_renderer.render_depth(depth_program, scene_renderer.get_view_projection());
+            shrek_renderer.render_depth(depth_program, scene_renderer.get_view_projection());
+            glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+
+            // opaque fragments are shaded only where they won the depth test in the pre-pass
+            glDepthMask(GL_FALSE);
+            glDepthFunc(GL_EQUAL);
+        }
+
+        fragment_invocations_query.begin(depth_prepass);
+
         scene_renderer.reset_params();
-        scene_renderer.render();
+        scene_renderer.render_opaque();
 
         shrek_renderer.reset_params();
         shrek_renderer.render();
 
+        // only the opaque pass: the pre-pass leaves blended fragments as they are
+        fragment_invocations_query.end();
+
+        glDepthMask(GL_TRUE);
+        glDepthFunc(GL_LEQUAL);
+
+        scene_renderer.reset_params();
+        scene_renderer.render_transparent();
+
 		SDL_GL_SwapWindow(window);
+
+        if (first_frame) {
+            first_frame = false;
+            std::cout << "First frame in " << std::chrono::duration<float, std::milli>(
+                    std::chrono::high_resolution_clock::now() - process_start).count() << " ms" << std::endl;
+        }
 	}
 
 	SDL_GL_DeleteContext(gl_context);